@@ -30,7 +30,8 @@ typedef enum : UInt32 {
 
 #define HV_PAGEALIGN(a)         (((a) + (PAGE_SIZE - 1)) &~ (PAGE_SIZE - 1))
 
-#define kHyperVHypercallRetryCount  100
+#define kHyperVHypercallRetryCount        100
+#define kHyperVHypercallRetryMaxDelayUS   2048
 
 
 #define kHyperVPCIBusSyntheticGraphics    0xFB
@@ -408,8 +409,19 @@ static inline int sync_test_and_clear_bit(long nr, volatile void *addr)
 #define CPUID3_HV_TIME_FREQ    0x0100  /* timer frequency query
              * (TSC, LAPIC) */
 #define CPUID3_HV_MSR_CRASH    0x0400  /* MSRs for guest crash */
+#define CPUID3_HV_STIMER_DIRECT    0x80000  /* direct synthetic timers */
 
 #define kHyperVCpuidLeafRecommends    0x40000004
+/* EAX: recommendations */
+#define CPUID4_HV_AS_SWITCH_HC     0x0001  /* hypercall for address space switch */
+#define CPUID4_HV_LOCAL_FLUSH_HC   0x0002  /* hypercall for local TLB flush */
+#define CPUID4_HV_REMOTE_FLUSH_HC  0x0004  /* hypercall for remote TLB flush */
+#define CPUID4_HV_APIC_MSRS        0x0008  /* MSRs for APIC access */
+#define CPUID4_HV_RESET_MSR        0x0010  /* MSR for system reset */
+#define CPUID4_HV_RELAXED_TIMING   0x0020  /* relaxed timing, no watchdogs */
+#define CPUID4_HV_NO_AUTO_EOI      0x0200  /* deprecate auto EOI */
+/* EBX: spinlock attempts before notifying the hypervisor */
+#define CPUID4_HV_SPIN_NEVER_NOTIFY  0xFFFFFFFF
 #define kHyperVCpuidLeafLimits        0x40000005
 #define kHyperVCpuidLeafHwFeatures    0x40000006
 
@@ -459,6 +471,36 @@ static inline int sync_test_and_clear_bit(long nr, volatile void *addr)
 #define kHyperVMsrReferenceTscRsvdMask          0x0FFEULL
 #define kHyperVMsrReferenceTscPageShift         PAGE_SHIFT
 
+//
+// Reference TSC page.
+// Reference time is ((TSC * tscScale) >> 64) + tscOffset, valid while tscSequence is unchanged.
+// A sequence of 0 indicates the page cannot be used and the MSR must be read instead.
+//
+#define kHyperVReferenceTscSequenceInvalid      0
+
+typedef struct __attribute__((packed)) {
+  volatile UInt32 tscSequence;
+  UInt32          reserved1;
+  volatile UInt64 tscScale;
+  volatile SInt64 tscOffset;
+} HyperVReferenceTscPage;
+
+//
+// High 64 bits of a 64x64 multiply, usable on both i386 and x86_64.
+//
+static inline UInt64 mulHigh64(UInt64 a, UInt64 b) {
+  UInt64 aLo = (UInt32) a;
+  UInt64 aHi = a >> 32;
+  UInt64 bLo = (UInt32) b;
+  UInt64 bHi = b >> 32;
+  UInt64 p0  = aLo * bLo;
+  UInt64 p1  = aLo * bHi;
+  UInt64 p2  = aHi * bLo;
+  UInt64 mid = (p0 >> 32) + (UInt32) p1 + (UInt32) p2;
+
+  return (aHi * bHi) + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+}
+
 #define kHyperVMsrEoi                           0x40000070
 
 #define kHyperVMsrSyncICControl                 0x40000080
@@ -490,11 +532,16 @@ static inline int sync_test_and_clear_bit(long nr, volatile void *addr)
 #define kHyperVMsrSTimerConfigPeriodic          0x0002ULL
 #define kHyperVMsrSTimerConfigLazy              0x0004ULL
 #define kHyperVMsrSTimerConfigAutoEnable        0x0008ULL
+#define kHyperVMsrSTimerConfigVectorMask        0x0FF0ULL
+#define kHyperVMsrSTimerConfigVectorShift       4
+#define kHyperVMsrSTimerConfigDirectMode        0x1000ULL
 #define kHyperVMsrSTimerConfigSIntMask          0x000F0000ULL
 #define kHyperVMsrSTimerConfigSIntShift         16
 
 #define kHyperVMsrSTimer0Count                  0x400000B1
 
+#define kHyperVMsrGuestIdle                     0x400000F0
+
 //
 // Message types
 //
@@ -561,9 +608,25 @@ typedef enum : UInt16 {
 
 #define kHypercallTypePostMessage   0x0005C // Slow hypercall, memory-based
 #define kHypercallTypeSignalEvent   0x1005D // Fast hypercall, register-based
+#define kHypercallTypeNotifyLongSpinWait  0x10008 // Fast hypercall, register-based
 
 #define kHypercallStatusMask        0xFFFF
 
+//
+// Hypercall input control value.
+//
+#define kHypercallControlFast           0x10000ULL
+#define kHypercallControlRepCountShift  32
+#define kHypercallControlRepStartShift  48
+#define kHypercallControlRepMask        0xFFFULL
+#define kHypercallRepCompleteShift      32
+
+//
+// XMM fast hypercall input is passed in RDX and R8, followed by XMM0-XMM5.
+//
+#define kHypercallXmmInputSize          112
+#define kHypercallXmmRegisterCount      6
+
 //
 // Message posting
 //
@@ -637,12 +700,27 @@ typedef struct __attribute__((packed)) {
 //
 // DMA buffer structure.
 //
+struct HyperVDMASlab;
+
 typedef struct {
   IOBufferMemoryDescriptor  *bufDesc;
   IODMACommand              *dmaCmd;
   mach_vm_address_t         physAddr;
   UInt8                     *buffer;
   size_t                    size;
+
+  //
+  // Page frame numbers for non-contiguous buffers.
+  // For contiguous buffers this is null, and physAddr covers the whole buffer.
+  //
+  UInt64                    *pfnArray;
+  UInt32                    pfnCount;
+
+  //
+  // Owning slab for buffers carved from the controller DMA pool.
+  // For buffers with their own memory descriptor this is null.
+  //
+  HyperVDMASlab             *slab;
 } HyperVDMABuffer;
 
 //
@@ -86,17 +86,24 @@ bool HyperVController::start(IOService *provider) {
     HVDBGLOG("HyperVPCIRoot is now loaded");
     
     //
-    // Setup hypercalls and interrupts.
+    // Setup DMA pool, hypercalls, and interrupts.
     //
+    if (!initDmaPool()) {
+      HVSYSLOG("Failed to initialize DMA pool");
+      break;
+    }
     if (!initHypercalls()) {
       HVSYSLOG("Failed to initialize hypercalls");
       break;
     }
+    initReferenceTsc();
     if (!initInterrupts()) {
       HVSYSLOG("Failed to initialize interrupts");
       break;
     }
     
+    publishEnlightenments();
+    
     //
     // Initialize VMBus root.
     //
@@ -115,6 +122,11 @@ bool HyperVController::start(IOService *provider) {
   return result;
 }
 
+void HyperVController::free() {
+  destroyDmaPool();
+  super::free();
+}
+
 bool HyperVController::identifyHyperV() {
   bool isHyperV = false;
   uint32_t regs[4];
@@ -203,9 +215,10 @@ bool HyperVController::identifyHyperV() {
            "\016HVDIS");      /* disabling hypervisor */
   
   do_cpuid(kHyperVCpuidLeafRecommends, regs);
-  _hvRecommends = regs[eax];
+  _hvRecommends  = regs[eax];
+  _hvSpinRetries = regs[ebx];
   HVDBGLOG("Hyper-V recommendations: 0x%X, max spinlock attempts: 0x%X",
-           _hvRecommends, regs[ebx]);
+           _hvRecommends, _hvSpinRetries);
   
   do_cpuid(kHyperVCpuidLeafLimits, regs);
   HVDBGLOG("Hyper-V max virtual CPUs: %u, max logical CPUs: %u, max interrupt vectors: %u",
@@ -259,35 +272,389 @@ bool HyperVController::initVMBus() {
   return true;
 }
 
-bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size) {
+void HyperVController::initReferenceTsc() {
+  UInt64 hvRefTsc;
+
+  if ((_hvFeatures & kHyperVCpuidMsrReferenceTsc) == 0 || !isTimeRefCounterSupported()) {
+    HVDBGLOG("Reference TSC page is not supported");
+    return;
+  }
+
+  //
+  // Allocate reference TSC page and enable it with Hyper-V.
+  // Time reads can then be done without exiting to the hypervisor.
+  //
+  if (!allocateDmaBuffer(&_refTscDma, PAGE_SIZE)) {
+    HVSYSLOG("Failed to allocate reference TSC page, falling back to MSR");
+    return;
+  }
+
+  hvRefTsc = rdmsr64(kHyperVMsrReferenceTsc);
+  hvRefTsc = ((_refTscDma.physAddr >> PAGE_SHIFT) << kHyperVMsrReferenceTscPageShift)
+             | (hvRefTsc & kHyperVMsrReferenceTscRsvdMask) | kHyperVMsrReferenceTscEnable;
+  wrmsr64(kHyperVMsrReferenceTsc, hvRefTsc);
+
+  hvRefTsc = rdmsr64(kHyperVMsrReferenceTsc);
+  if ((hvRefTsc & kHyperVMsrReferenceTscEnable) == 0) {
+    HVSYSLOG("Failed to enable reference TSC page, falling back to MSR");
+    freeDmaBuffer(&_refTscDma);
+    return;
+  }
+
+  _refTscPage = (HyperVReferenceTscPage*) _refTscDma.buffer;
+  HVDBGLOG("Reference TSC page enabled at phys 0x%llX (sequence %u)", _refTscDma.physAddr, _refTscPage->tscSequence);
+}
+
+void HyperVController::publishEnlightenments() {
+  OSDictionary *enlightenDict;
+  OSNumber     *spinNumber;
+
+  enlightenDict = OSDictionary::withCapacity(7);
+  if (enlightenDict == nullptr) {
+    return;
+  }
+
+  //
+  // Publish the enlightenments in use, and those recommended by Hyper-V.
+  //
+  enlightenDict->setObject("RelaxedTiming", isRelaxedTimingRecommended() ? kOSBooleanTrue : kOSBooleanFalse);
+  enlightenDict->setObject("GuestIdle", isGuestIdleSupported() ? kOSBooleanTrue : kOSBooleanFalse);
+  enlightenDict->setObject("XMMHypercalls", isXmmHypercallSupported() ? kOSBooleanTrue : kOSBooleanFalse);
+  enlightenDict->setObject("ReferenceTSC", (_refTscPage != nullptr) ? kOSBooleanTrue : kOSBooleanFalse);
+  enlightenDict->setObject("SyntheticTimers", isSyntheticTimerSupported() ? kOSBooleanTrue : kOSBooleanFalse);
+  enlightenDict->setObject("DirectSyntheticTimers", _stimerDirectMode ? kOSBooleanTrue : kOSBooleanFalse);
+
+  spinNumber = OSNumber::withNumber(isLongSpinWaitNotifyRecommended() ? _hvSpinRetries : 0, 32);
+  if (spinNumber != nullptr) {
+    enlightenDict->setObject("LongSpinWaitRetries", spinNumber);
+    spinNumber->release();
+  }
+
+  setProperty("HyperVEnlightenments", enlightenDict);
+  enlightenDict->release();
+}
+
+bool HyperVController::initDmaPool() {
+  _dmaPoolLock = IOLockAlloc();
+  if (_dmaPoolLock == nullptr) {
+    return false;
+  }
+
+  //
+  // Size classes are powers of two up to a full page, chunks are naturally aligned.
+  //
+  for (UInt32 i = 0; i < arrsize(_dmaPoolClasses); i++) {
+    _dmaPoolClasses[i].chunkSize  = 1 << (kHyperVDMAPoolMinChunkShift + i);
+    _dmaPoolClasses[i].chunkCount = (UInt32)(PAGE_SIZE / _dmaPoolClasses[i].chunkSize);
+  }
+  updateDmaPoolProperties();
+  return true;
+}
+
+bool HyperVController::allocatePooledDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size) {
+  HyperVDMAPoolClass *poolClass;
+  HyperVDMASlab      *slab;
+  UInt32             classIndex;
+  UInt32             chunkIndex;
+  bool               slabAdded = false;
+
+  if (_dmaPoolLock == nullptr || size == 0 || size > PAGE_SIZE) {
+    return false;
+  }
+
+  for (classIndex = 0; classIndex < arrsize(_dmaPoolClasses) - 1; classIndex++) {
+    if (size <= _dmaPoolClasses[classIndex].chunkSize) {
+      break;
+    }
+  }
+  poolClass = &_dmaPoolClasses[classIndex];
+
+  IOLockLock(_dmaPoolLock);
+  for (slab = poolClass->slabs; slab != nullptr; slab = slab->next) {
+    if (slab->freeMap != 0) {
+      break;
+    }
+  }
+
+  //
+  // No free chunks in this class, add a new slab.
+  //
+  if (slab == nullptr) {
+    slab = (HyperVDMASlab *)IOMalloc(sizeof (*slab));
+    if (slab == nullptr) {
+      IOLockUnlock(_dmaPoolLock);
+      HVSYSLOG("Failed to allocate DMA pool slab");
+      return false;
+    }
+    bzero(slab, sizeof (*slab));
+
+    slab->bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous,
+                                                                     PAGE_SIZE, 0xFFFFFFFFFFFFF000ULL);
+    if (slab->bufDesc == nullptr) {
+      IOLockUnlock(_dmaPoolLock);
+      IOFree(slab, sizeof (*slab));
+      HVSYSLOG("Failed to allocate DMA pool slab memory");
+      return false;
+    }
+    slab->bufDesc->prepare();
+
+    slab->physAddr   = slab->bufDesc->getPhysicalAddress();
+    slab->buffer     = (UInt8*) slab->bufDesc->getBytesNoCopy();
+    slab->freeMap    = (poolClass->chunkCount == 64) ? ~0ULL : ((1ULL << poolClass->chunkCount) - 1);
+    slab->classIndex = classIndex;
+
+    slab->next       = poolClass->slabs;
+    poolClass->slabs = slab;
+    poolClass->slabCount++;
+    poolClass->emptySlabCount++;
+    slabAdded = true;
+    HVDBGLOG("Added DMA pool slab at 0x%llX for %u byte chunks", slab->physAddr, poolClass->chunkSize);
+  }
+
+  chunkIndex = (UInt32)__builtin_ctzll(slab->freeMap);
+  slab->freeMap &= ~(1ULL << chunkIndex);
+  if (slab->inUseCount++ == 0) {
+    poolClass->emptySlabCount--;
+  }
+  poolClass->inUseCount++;
+  poolClass->allocationCount++;
+  IOLockUnlock(_dmaPoolLock);
+
+  dmaBuf->bufDesc  = nullptr;
+  dmaBuf->dmaCmd   = nullptr;
+  dmaBuf->physAddr = slab->physAddr + ((mach_vm_address_t)chunkIndex * poolClass->chunkSize);
+  dmaBuf->buffer   = slab->buffer + ((size_t)chunkIndex * poolClass->chunkSize);
+  dmaBuf->size     = size;
+  dmaBuf->pfnArray = nullptr;
+  dmaBuf->pfnCount = 0;
+  dmaBuf->slab     = slab;
+
+  memset(dmaBuf->buffer, 0, dmaBuf->size);
+  if (slabAdded) {
+    updateDmaPoolProperties();
+  }
+  return true;
+}
+
+void HyperVController::freePooledDmaBuffer(HyperVDMABuffer *dmaBuf) {
+  HyperVDMASlab      *slab      = dmaBuf->slab;
+  HyperVDMAPoolClass *poolClass = &_dmaPoolClasses[slab->classIndex];
+  HyperVDMASlab      **slabLink;
+  UInt32             chunkIndex;
+
+  chunkIndex = (UInt32)((dmaBuf->buffer - slab->buffer) / poolClass->chunkSize);
+  bzero(dmaBuf, sizeof (*dmaBuf));
+
+  IOLockLock(_dmaPoolLock);
+  slab->freeMap |= (1ULL << chunkIndex);
+  poolClass->inUseCount--;
+  if (--slab->inUseCount == 0) {
+    poolClass->emptySlabCount++;
+
+    //
+    // Keep a few empty slabs cached, release the rest.
+    //
+    if (poolClass->emptySlabCount > kHyperVDMAPoolMaxEmptySlabs) {
+      for (slabLink = &poolClass->slabs; *slabLink != nullptr; slabLink = &(*slabLink)->next) {
+        if (*slabLink == slab) {
+          *slabLink = slab->next;
+          break;
+        }
+      }
+      poolClass->slabCount--;
+      poolClass->emptySlabCount--;
+    } else {
+      slab = nullptr;
+    }
+  } else {
+    slab = nullptr;
+  }
+  IOLockUnlock(_dmaPoolLock);
+
+  if (slab != nullptr) {
+    HVDBGLOG("Releasing DMA pool slab at 0x%llX for %u byte chunks", slab->physAddr, poolClass->chunkSize);
+    slab->bufDesc->complete();
+    slab->bufDesc->release();
+    IOFree(slab, sizeof (*slab));
+    updateDmaPoolProperties();
+  }
+}
+
+void HyperVController::destroyDmaPool() {
+  HyperVDMASlab *slab;
+
+  if (_dmaPoolLock == nullptr) {
+    return;
+  }
+
+  //
+  // Release all slabs, any pooled buffers still held are no longer valid.
+  //
+  for (UInt32 i = 0; i < arrsize(_dmaPoolClasses); i++) {
+    if (_dmaPoolClasses[i].inUseCount != 0) {
+      HVSYSLOG("%u DMA pool buffers of %u bytes are still in use", _dmaPoolClasses[i].inUseCount, _dmaPoolClasses[i].chunkSize);
+    }
+
+    while (_dmaPoolClasses[i].slabs != nullptr) {
+      slab = _dmaPoolClasses[i].slabs;
+      _dmaPoolClasses[i].slabs = slab->next;
+
+      slab->bufDesc->complete();
+      slab->bufDesc->release();
+      IOFree(slab, sizeof (*slab));
+    }
+    bzero(&_dmaPoolClasses[i], sizeof (_dmaPoolClasses[i]));
+  }
+
+  IOLockFree(_dmaPoolLock);
+  _dmaPoolLock = nullptr;
+}
+
+void HyperVController::updateDmaPoolProperties() {
+  //
+  // Pool statistics are published only when slabs are added or released, keeping
+  // registry updates out of the allocation path. Usage counts are as of the last slab change.
+  //
+  HyperVDMAPoolClass poolClasses[kHyperVDMAPoolClassCount];
+  OSDictionary       *poolDict;
+  OSDictionary       *classDict;
+  OSNumber           *statNumber;
+  char               classKey[16];
+
+  IOLockLock(_dmaPoolLock);
+  memcpy(poolClasses, _dmaPoolClasses, sizeof (poolClasses));
+  IOLockUnlock(_dmaPoolLock);
+
+  poolDict = OSDictionary::withCapacity(kHyperVDMAPoolClassCount);
+  if (poolDict == nullptr) {
+    return;
+  }
+
+  for (UInt32 i = 0; i < arrsize(poolClasses); i++) {
+    classDict = OSDictionary::withCapacity(3);
+    if (classDict == nullptr) {
+      continue;
+    }
+
+    statNumber = OSNumber::withNumber(poolClasses[i].slabCount, 32);
+    if (statNumber != nullptr) {
+      classDict->setObject("Slabs", statNumber);
+      statNumber->release();
+    }
+    statNumber = OSNumber::withNumber(poolClasses[i].inUseCount, 32);
+    if (statNumber != nullptr) {
+      classDict->setObject("InUse", statNumber);
+      statNumber->release();
+    }
+    statNumber = OSNumber::withNumber(poolClasses[i].allocationCount, 64);
+    if (statNumber != nullptr) {
+      classDict->setObject("Allocations", statNumber);
+      statNumber->release();
+    }
+
+    snprintf(classKey, sizeof (classKey), "%u", poolClasses[i].chunkSize);
+    poolDict->setObject(classKey, classDict);
+    classDict->release();
+  }
+
+  setProperty("HyperVDMAPool", poolDict);
+  poolDict->release();
+}
+
+bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size, bool contiguous) {
   IOBufferMemoryDescriptor *bufDesc;
-  
+  IOOptionBits             options = kIODirectionInOut;
+  UInt64                   *pfnArray = nullptr;
+  UInt32                   pfnCount  = 0;
+  addr64_t                 segPhysAddr;
+  IOByteCount              segLength;
+
+  //
+  // Contiguous buffers of a page or less are carved from the DMA pool.
+  //
+  if (contiguous && size <= PAGE_SIZE && allocatePooledDmaBuffer(dmaBuf, size)) {
+    return true;
+  }
+
+  //
+  // Non-contiguous buffers must be whole pages, as each page is described separately.
+  //
+  if (contiguous) {
+    options |= kIOMemoryPhysicallyContiguous;
+  } else {
+    size = round_page(size);
+  }
+
   //
   // Create page-aligned DMA buffer and get physical address.
   //
-  bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
-                                                             kIODirectionInOut | kIOMemoryPhysicallyContiguous,
-                                                             size, 0xFFFFFFFFFFFFF000ULL);
+  bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, options, size, 0xFFFFFFFFFFFFF000ULL);
   if (bufDesc == nullptr) {
     HVSYSLOG("Failed to allocate DMA buffer memory of %u bytes", size);
     return false;
   }
   bufDesc->prepare();
-  
+
+  //
+  // Walk physical segments of non-contiguous buffers to get the page frame number of each page.
+  //
+  if (!contiguous) {
+    pfnCount = (UInt32)(size >> PAGE_SHIFT);
+    pfnArray = (UInt64 *)IOMalloc(sizeof (*pfnArray) * pfnCount);
+    if (pfnArray == nullptr) {
+      HVSYSLOG("Failed to allocate PFN array for DMA buffer of %u bytes", size);
+      bufDesc->complete();
+      bufDesc->release();
+      return false;
+    }
+
+    for (UInt32 i = 0; i < pfnCount; ) {
+#if __MAC_OS_X_VERSION_MIN_REQUIRED < __MAC_10_6
+      segPhysAddr = bufDesc->getPhysicalSegment64((IOByteCount)i << PAGE_SHIFT, &segLength);
+#else
+      segPhysAddr = bufDesc->getPhysicalSegment((IOByteCount)i << PAGE_SHIFT, &segLength, kIOMemoryMapperNone);
+#endif
+      if (segPhysAddr == 0 || segLength == 0) {
+        HVSYSLOG("Failed to get physical segment at page %u of DMA buffer", i);
+        IOFree(pfnArray, sizeof (*pfnArray) * pfnCount);
+        bufDesc->complete();
+        bufDesc->release();
+        return false;
+      }
+
+      for (IOByteCount segOffset = 0; segOffset < segLength && i < pfnCount; segOffset += PAGE_SIZE, i++) {
+        pfnArray[i] = (segPhysAddr + segOffset) >> PAGE_SHIFT;
+      }
+    }
+  }
+
   dmaBuf->bufDesc  = bufDesc;
   dmaBuf->physAddr = bufDesc->getPhysicalAddress();
   dmaBuf->buffer   = (UInt8*) bufDesc->getBytesNoCopy();
   dmaBuf->size     = size;
+  dmaBuf->pfnArray = pfnArray;
+  dmaBuf->pfnCount = pfnCount;
+  dmaBuf->slab     = nullptr;
   
   memset(dmaBuf->buffer, 0, dmaBuf->size);
-  HVDBGLOG("Mapped buffer of %u bytes to 0x%llX", dmaBuf->size, dmaBuf->physAddr);
+  HVDBGLOG("Mapped buffer of %u bytes to 0x%llX (%s)", dmaBuf->size, dmaBuf->physAddr, contiguous ? "contiguous" : "scattered");
   return true;
 }
 
 void HyperVController::freeDmaBuffer(HyperVDMABuffer *dmaBuf) {
-  IOBufferMemoryDescriptor *bufDesc = dmaBuf->bufDesc;
+  IOBufferMemoryDescriptor *bufDesc  = dmaBuf->bufDesc;
+  UInt64                   *pfnArray = dmaBuf->pfnArray;
+  UInt32                   pfnCount  = dmaBuf->pfnCount;
+
+  if (dmaBuf->slab != nullptr) {
+    freePooledDmaBuffer(dmaBuf);
+    return;
+  }
 
   bzero(dmaBuf, sizeof (*dmaBuf));
+  if (pfnArray != nullptr) {
+    IOFree(pfnArray, sizeof (*pfnArray) * pfnCount);
+  }
   if (bufDesc != nullptr) {
     bufDesc->complete();
     OSSafeReleaseNULL(bufDesc);
@@ -19,6 +19,8 @@ extern "C" {
 #include <i386/pmCPU.h>
 }
 
+#define kHyperVMessageQueueLength   16
+
 typedef struct {
   UInt32                  *interruptVector;
   bool                    *supportsHvVpIndex;
@@ -33,9 +35,46 @@ typedef struct {
   volatile HyperVEventFlags        *eventFlags; //TODO: testing
   
   HyperVDMABuffer         postMessageDma;
+
+  //
+  // VMBus management messages copied out of the SynIC message slot in interrupt context.
+  // Single producer (interrupt on this CPU), single consumer (VMBus work loop).
+  //
+  HyperVMessage           messageQueue[kHyperVMessageQueueLength];
+  volatile UInt32         messageQueueHead;
+  volatile UInt32         messageQueueTail;
 } HyperVCPUData;
 
+//
+// DMA pool.
+// Each slab is a single physically contiguous page carved into chunks of one size class.
+//
+#define kHyperVDMAPoolMinChunkShift   6
+#define kHyperVDMAPoolClassCount      (PAGE_SHIFT - kHyperVDMAPoolMinChunkShift + 1)
+#define kHyperVDMAPoolMaxEmptySlabs   2
+
+struct HyperVDMASlab {
+  HyperVDMASlab             *next;
+  IOBufferMemoryDescriptor  *bufDesc;
+  mach_vm_address_t         physAddr;
+  UInt8                     *buffer;
+  UInt64                    freeMap;
+  UInt32                    classIndex;
+  UInt32                    inUseCount;
+};
+
+typedef struct {
+  HyperVDMASlab             *slabs;
+  UInt32                    chunkSize;
+  UInt32                    chunkCount;
+  UInt32                    slabCount;
+  UInt32                    emptySlabCount;
+  UInt32                    inUseCount;
+  UInt64                    allocationCount;
+} HyperVDMAPoolClass;
+
 class HyperVInterruptController;
+class HyperVSyntheticTimer;
 class HyperVVMBus;
 class HyperVUserClient;
 
@@ -54,6 +93,7 @@ private:
   UInt32 _hvFeatures3    = 0;
   UInt16 _hvMajorVersion = 0;
   UInt32 _hvRecommends   = 0;
+  UInt32 _hvSpinRetries  = CPUID4_HV_SPIN_NEVER_NOTIFY;
   
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
   pmCallBacks_t _pmCallbacks     = { };
@@ -65,6 +105,13 @@ private:
   //
   void                *hypercallPage = nullptr;
   IOMemoryDescriptor  *hypercallDesc = nullptr;
+  bool                _useXmmHypercalls = false;
+
+  //
+  // Reference TSC page.
+  //
+  HyperVDMABuffer         _refTscDma  = { };
+  HyperVReferenceTscPage  *_refTscPage = nullptr;
   
   //
   // Interrupt and event data.
@@ -76,15 +123,41 @@ private:
   bool              _useLegacyEventFlags = false;
   HyperVEventFlags  *_vmbusRxEventFlags  = nullptr;
   
+  //
+  // Synthetic timer 0 is shared by all synthetic timer event sources.
+  // It is armed for the earliest deadline, on the processor that armed it.
+  //
+  IOSimpleLock          *_stimerLock      = nullptr;
+  HyperVSyntheticTimer  *_stimerList      = nullptr;
+  UInt64                _stimerDeadline   = 0;
+  bool                  _stimerDirectMode = false;
+  
   HyperVInterruptController *_hvInterruptController = nullptr;
   HyperVVMBus               *_hvVMBus               = nullptr;
   HyperVUserClient          *_userClientInstance    = nullptr;
+
+  //
+  // DMA pool for page and sub-page buffers.
+  //
+  IOLock             *_dmaPoolLock = nullptr;
+  HyperVDMAPoolClass _dmaPoolClasses[kHyperVDMAPoolClassCount] = { };
   
   //
   // Misc functions.
   //
   bool identifyHyperV();
   bool initVMBus();
+  void initReferenceTsc();
+  void publishEnlightenments();
+
+  //
+  // DMA pool.
+  //
+  bool initDmaPool();
+  bool allocatePooledDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size);
+  void freePooledDmaBuffer(HyperVDMABuffer *dmaBuf);
+  void destroyDmaPool();
+  void updateDmaPoolProperties();
   
   //
   // Hypercalls/interrupts.
@@ -92,22 +165,37 @@ private:
   bool initHypercalls();
   void destroyHypercalls();
   void freeHypercallPage();
+  UInt64 hypercallMemory(UInt64 control, mach_vm_address_t inputPhysAddr, mach_vm_address_t outputPhysAddr);
+#if defined(__x86_64__)
+  UInt64 hypercallFastXmm(UInt64 control, const void *input, UInt32 inputSize);
+#endif
   bool allocateInterruptBuffers();
   bool initInterrupts();
   void destroySynIC();
   void handleInterrupt(OSObject *target, void *refCon, IOService *nub, int source);
+  bool queueSynICMessage(UInt32 cpu);
+  void initSyntheticTimer();
+  void programSyntheticTimer(UInt64 deadline);
+  void handleSyntheticTimer();
   
 public:
   //
   // IOService overrides.
   //
   bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  void free() APPLE_KEXT_OVERRIDE;
   
   //
   // Misc functions.
   //
-  bool allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size);
+  bool allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size, bool contiguous = true);
   void freeDmaBuffer(HyperVDMABuffer *dmaBuf);
+  inline mach_vm_address_t getDmaBufferPhysAddr(HyperVDMABuffer *dmaBuf, size_t offset) {
+    if (dmaBuf->pfnArray == nullptr) {
+      return dmaBuf->physAddr + offset;
+    }
+    return (dmaBuf->pfnArray[offset >> PAGE_SHIFT] << PAGE_SHIFT) | (offset & PAGE_MASK);
+  }
   bool addInterruptProperties(OSDictionary *dict, UInt32 interruptVector);
   
   //
@@ -115,15 +203,64 @@ public:
   //
   HypercallStatus hypercallPostMessage(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size);
   HypercallStatus hypercallSignalEvent(UInt32 connectionId);
+  HypercallStatus hypercallNotifyLongSpinWait(UInt32 spinCount);
+  HypercallStatus hypercallRep(UInt16 callCode, UInt16 repCount, mach_vm_address_t inputPhysAddr, mach_vm_address_t outputPhysAddr);
+  inline bool isXmmHypercallSupported() { return _useXmmHypercalls; }
   bool enableInterrupts(HyperVEventFlags *legacyEventFlags = nullptr);
   void disableInterrupts();
   void sendSynICEOM(UInt32 cpu);
+  void signalSynICEOM(UInt32 cpu);
+  bool dequeueSynICMessage(UInt32 cpu, HyperVMessage *message);
+  
+  //
+  // Synthetic timers.
+  //
+  inline bool isSyntheticTimerSupported() { return _stimerLock != nullptr; }
+  void registerSyntheticTimer(HyperVSyntheticTimer *timer);
+  void unregisterSyntheticTimer(HyperVSyntheticTimer *timer);
+  void armSyntheticTimer(HyperVSyntheticTimer *timer, UInt64 deadline);
+  void cancelSyntheticTimer(HyperVSyntheticTimer *timer);
+  
+  //
+  // Enlightenments recommended by Hyper-V.
+  // Spinning code should notify Hyper-V after the recommended number of attempts, so another virtual CPU can run.
+  //
+  inline bool isLongSpinWaitNotifyRecommended() { return _hvSpinRetries != CPUID4_HV_SPIN_NEVER_NOTIFY; }
+  inline UInt32 getLongSpinWaitRetries() { return _hvSpinRetries; }
+  inline bool isRelaxedTimingRecommended() { return (_hvRecommends & CPUID4_HV_RELAXED_TIMING) != 0; }
+  inline bool isGuestIdleSupported() { return (_hvFeatures & kHyperVCpuidMsrGuestIdle) != 0; }
   
   //
   // Time reference counter.
+  // Reads from the reference TSC page where possible, falling back to the MSR.
+  // The MSR is required, as the page may be marked invalid by Hyper-V at any time.
   //
-  inline bool isTimeRefCounterSupported() { return (_hvFeatures & kHyperVCpuidMsrTimeRefCnt); }
-  inline UInt64 readTimeRefCounter() { return isTimeRefCounterSupported() ? rdmsr64(kHyperVMsrTimeRefCount) : 0; }
+  inline bool isTimeRefCounterSupported() { return (_hvFeatures & kHyperVCpuidMsrTimeRefCnt) != 0; }
+  inline UInt64 readTimeRefCounter() {
+    UInt32 sequence;
+    UInt64 tsc;
+    UInt64 scale;
+    SInt64 offset;
+
+    if (_refTscPage != nullptr) {
+      do {
+        sequence = _refTscPage->tscSequence;
+        if (sequence == kHyperVReferenceTscSequenceInvalid) {
+          break;
+        }
+        __asm__ volatile ("lfence" ::: "memory");
+        tsc    = rdtsc64();
+        scale  = _refTscPage->tscScale;
+        offset = _refTscPage->tscOffset;
+        __asm__ volatile ("" ::: "memory");
+
+        if (_refTscPage->tscSequence == sequence) {
+          return mulHigh64(tsc, scale) + offset;
+        }
+      } while (true);
+    }
+    return (_hvFeatures & kHyperVCpuidMsrTimeRefCnt) ? rdmsr64(kHyperVMsrTimeRefCount) : 0;
+  }
 
   //
   // Messages.
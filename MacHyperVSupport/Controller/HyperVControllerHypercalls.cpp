@@ -64,7 +64,14 @@ bool HyperVController::initHypercalls() {
     return false;
   }
 
-  HVDBGLOG("Hypercalls are now enabled");
+  //
+  // Small messages can be posted through XMM registers instead of the per-CPU post message page.
+  // This is only implemented for 64-bit, as R8 is used for input.
+  //
+#if defined(__x86_64__)
+  _useXmmHypercalls = (_hvFeatures3 & CPUID3_HV_XMM_HYPERCALL) && !checkKernelArgument("-hvctrlnoxmm");
+#endif
+  HVDBGLOG("Hypercalls are now enabled (XMM fast input: %s)", _useXmmHypercalls ? "yes" : "no");
   return true;
 }
 
@@ -94,6 +101,86 @@ void HyperVController::freeHypercallPage() {
   }
 }
 
+UInt64 HyperVController::hypercallMemory(UInt64 control, mach_vm_address_t inputPhysAddr, mach_vm_address_t outputPhysAddr) {
+  UInt64 status;
+
+  //
+  // Perform a memory-based hypercall.
+  //
+  // During hypercall, the calling processor will be suspended until the hypercall returns.
+  // Linux disables preemption during this time, but unsure if that is needed due to the above.
+  //
+#if defined(__i386__)
+  asm volatile ("call *%7" : "=A" (status) : "d" ((UInt32)(control >> 32)), "a" ((UInt32) control),
+                "b" ((UInt32)(inputPhysAddr >> 32)), "c" ((UInt32) inputPhysAddr),
+                "D" ((UInt32)(outputPhysAddr >> 32)), "S" ((UInt32) outputPhysAddr), "m" (hypercallPage) : "memory");
+#elif defined(__x86_64__)
+  register UInt64 output asm("r8") = outputPhysAddr;
+  asm volatile ("call *%4" : "=a" (status) : "c" (control), "d" (inputPhysAddr), "r" (output), "m" (hypercallPage) : "memory");
+#else
+#error Unsupported arch
+#endif
+  return status;
+}
+
+#if defined(__x86_64__)
+UInt64 HyperVController::hypercallFastXmm(UInt64 control, const void *input, UInt32 inputSize) {
+  UInt64 status;
+  UInt64 inputRegs[kHypercallXmmInputSize / sizeof (UInt64)] __attribute__((aligned(16)));
+  UInt8  xmmSave[kHypercallXmmRegisterCount * 16] __attribute__((aligned(16)));
+  UInt64 cr0;
+  bool   intsEnabled;
+
+  if (inputSize > sizeof (inputRegs)) {
+    return kHypercallStatusInvalidParameter;
+  }
+  bzero(inputRegs, sizeof (inputRegs));
+  memcpy(inputRegs, input, inputSize);
+
+  //
+  // XMM registers are not otherwise used by the kernel, preserve their contents
+  // and stay on this processor until they are restored.
+  // Clear CR0.TS so the XMM accesses do not fault on lazily switched FPU state.
+  //
+  intsEnabled = ml_set_interrupts_enabled(false);
+  cr0 = get_cr0();
+  if (cr0 & CR0_TS) {
+    clear_ts();
+  }
+
+  register UInt64 input2 asm("r8") = inputRegs[1];
+  asm volatile ("movdqa %%xmm0, 0x00(%[save])\n\t"
+                "movdqa %%xmm1, 0x10(%[save])\n\t"
+                "movdqa %%xmm2, 0x20(%[save])\n\t"
+                "movdqa %%xmm3, 0x30(%[save])\n\t"
+                "movdqa %%xmm4, 0x40(%[save])\n\t"
+                "movdqa %%xmm5, 0x50(%[save])\n\t"
+                "movdqa 0x10(%[in]), %%xmm0\n\t"
+                "movdqa 0x20(%[in]), %%xmm1\n\t"
+                "movdqa 0x30(%[in]), %%xmm2\n\t"
+                "movdqa 0x40(%[in]), %%xmm3\n\t"
+                "movdqa 0x50(%[in]), %%xmm4\n\t"
+                "movdqa 0x60(%[in]), %%xmm5\n\t"
+                "call *%[page]\n\t"
+                "movdqa 0x00(%[save]), %%xmm0\n\t"
+                "movdqa 0x10(%[save]), %%xmm1\n\t"
+                "movdqa 0x20(%[save]), %%xmm2\n\t"
+                "movdqa 0x30(%[save]), %%xmm3\n\t"
+                "movdqa 0x40(%[save]), %%xmm4\n\t"
+                "movdqa 0x50(%[save]), %%xmm5\n\t"
+                : "=&a" (status)
+                : "c" (control | kHypercallControlFast), "d" (inputRegs[0]), "r" (input2),
+                  [in] "r" (inputRegs), [save] "r" (xmmSave), [page] "m" (hypercallPage)
+                : "memory");
+
+  if (cr0 & CR0_TS) {
+    set_ts();
+  }
+  ml_set_interrupts_enabled(intsEnabled);
+  return status;
+}
+#endif
+
 HypercallStatus HyperVController::hypercallPostMessage(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size) {
   UInt64 status;
 
@@ -102,6 +189,35 @@ HypercallStatus HyperVController::hypercallPostMessage(UInt32 connectionId, Hype
     return kHypercallStatusInvalidParameter;
   }
 
+#if defined(__x86_64__)
+  //
+  // Post smaller messages with XMM fast input, avoiding the post message page.
+  //
+  if (_useXmmHypercalls && (size <= kHypercallXmmInputSize - offsetof(HypercallPostMessage, data))) {
+    UInt8                xmmInput[kHypercallXmmInputSize];
+    HypercallPostMessage *postMessage = (HypercallPostMessage*) xmmInput;
+
+    postMessage->connectionId = connectionId;
+    postMessage->reserved     = 0;
+    postMessage->messageType  = messageType;
+    postMessage->size         = size;
+    memcpy(&postMessage->data[0], data, size);
+
+    status = hypercallFastXmm(kHypercallTypePostMessage, xmmInput, (UInt32)(offsetof(HypercallPostMessage, data) + size));
+    status &= kHypercallStatusMask;
+
+    //
+    // Hyper-V may advertise XMM input but reject it for HvPostMessage, as its input is larger than the XMM registers.
+    // Fall back to the post message page for this and all further messages.
+    //
+    if (status != kHypercallStatusInvalidHypercallInput && status != kHypercallStatusInvalidHypercallCode) {
+      return (HypercallStatus) status;
+    }
+    HVSYSLOG("XMM fast post message failed with status 0x%llX, disabling XMM fast input", status);
+    _useXmmHypercalls = false;
+  }
+#endif
+
   //
   // Get per-CPU hypercall post message page.
   //
@@ -117,31 +233,62 @@ HypercallStatus HyperVController::hypercallPostMessage(UInt32 connectionId, Hype
   //
   // Perform HvPostMessage hypercall.
   //
-  // During hypercall, the calling processor will be suspended until the hypercall returns.
-  // Linux disables preemption during this time, but unsure if that is needed due to the above.
+  status = hypercallMemory(kHypercallTypePostMessage, postPageBuffer->physAddr, 0);
+  return (HypercallStatus)(status & kHypercallStatusMask);
+}
+
+HypercallStatus HyperVController::hypercallSignalEvent(UInt32 connectionId) {
+  UInt64 status;
+
+  //
+  // Perform a fast version of HvSignalEvent hypercall.
   //
 #if defined(__i386__)
-  asm volatile ("call *%5" : "=A" (status) : "d" (0), "a" (kHypercallTypePostMessage), "b" (0), "c" ((uint32_t) postPageBuffer->physAddr), "m" (hypercallPage));
+  asm volatile ("call *%5" : "=A" (status) : "d" (0), "a" (kHypercallTypeSignalEvent), "b" (0), "c" (connectionId), "m" (hypercallPage));
 #elif defined(__x86_64__)
-  asm volatile ("call *%3" : "=a" (status) : "c" (kHypercallTypePostMessage), "d" (postPageBuffer->physAddr), "m" (hypercallPage));
+  asm volatile ("call *%3" : "=a" (status) : "c" (kHypercallTypeSignalEvent), "d" (connectionId), "m" (hypercallPage));
 #else
 #error Unsupported arch
 #endif
   return (HypercallStatus)(status & kHypercallStatusMask);
 }
 
-HypercallStatus HyperVController::hypercallSignalEvent(UInt32 connectionId) {
+HypercallStatus HyperVController::hypercallNotifyLongSpinWait(UInt32 spinCount) {
   UInt64 status;
 
   //
-  // Perform a fast version of HvSignalEvent hypercall.
+  // Perform a fast version of HvNotifyLongSpinWait hypercall.
   //
 #if defined(__i386__)
-  asm volatile ("call *%5" : "=A" (status) : "d" (0), "a" (kHypercallTypeSignalEvent), "b" (0), "c" (connectionId), "m" (hypercallPage));
+  asm volatile ("call *%5" : "=A" (status) : "d" (0), "a" (kHypercallTypeNotifyLongSpinWait), "b" (0), "c" (spinCount), "m" (hypercallPage));
 #elif defined(__x86_64__)
-  asm volatile ("call *%3" : "=a" (status) : "c" (kHypercallTypeSignalEvent), "d" (connectionId), "m" (hypercallPage));
+  asm volatile ("call *%3" : "=a" (status) : "c" (kHypercallTypeNotifyLongSpinWait), "d" ((UInt64) spinCount), "m" (hypercallPage));
 #else
 #error Unsupported arch
 #endif
   return (HypercallStatus)(status & kHypercallStatusMask);
 }
+
+HypercallStatus HyperVController::hypercallRep(UInt16 callCode, UInt16 repCount, mach_vm_address_t inputPhysAddr, mach_vm_address_t outputPhysAddr) {
+  UInt64 control;
+  UInt64 status;
+  UInt16 repsComplete = 0;
+
+  if (repCount == 0 || repCount > kHypercallControlRepMask) {
+    return kHypercallStatusInvalidParameter;
+  }
+
+  //
+  // Perform a rep hypercall over an array of input elements, for use by children batching per-element operations.
+  // Hyper-V may return before all elements are processed, continue from the last completed element.
+  //
+  do {
+    control = callCode
+              | ((UInt64) repCount << kHypercallControlRepCountShift)
+              | ((UInt64) repsComplete << kHypercallControlRepStartShift);
+    status = hypercallMemory(control, inputPhysAddr, outputPhysAddr);
+    repsComplete = (UInt16)((status >> kHypercallRepCompleteShift) & kHypercallControlRepMask);
+  } while ((status & kHypercallStatusMask) == kHypercallStatusSuccess && repsComplete < repCount);
+
+  return (HypercallStatus)(status & kHypercallStatusMask);
+}
@@ -7,6 +7,7 @@
 
 #include "HyperVController.hpp"
 #include "HyperVInterruptController.hpp"
+#include "HyperVSyntheticTimer.hpp"
 #include "VMBus.hpp"
 
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
@@ -234,6 +235,7 @@ bool HyperVController::initInterrupts() {
   // Setup SynIC interrupts on all processors.
   //
   mp_rendezvous_no_intrs(initCPUSyncIC, _cpuData);
+  initSyntheticTimer();
   return true;
 }
 
@@ -243,6 +245,7 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
 
   //
   // Handle timer messages.
+  // In direct mode, synthetic timers share the VMBus interrupt vector and do not send messages.
   //
   message = getPendingMessage(cpuIndex, kVMBusInterruptTimer);
   if (message->type == kHyperVMessageTypeTimerExpired) {
@@ -251,6 +254,9 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
     if (message->flags.messagePending) {
       wrmsr64(kHyperVMsrEom, 0);
     }
+    handleSyntheticTimer();
+  } else if (_stimerDirectMode) {
+    handleSyntheticTimer();
   }
 
   //
@@ -282,13 +288,84 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
 
   //
   // Handle VMBus management messages.
+  // The message is queued and the slot released here on the receiving CPU, avoiding a later EOM from another CPU.
   //
   message = getPendingMessage(cpuIndex, kVMBusInterruptMessage);
   if (message->type != kHyperVMessageTypeNone) {
+    queueSynICMessage(cpuIndex);
     _hvInterruptController->handleInterrupt(nullptr, nullptr, 0);
   }
 }
 
+bool HyperVController::queueSynICMessage(UInt32 cpu) {
+  HyperVCPUData *cpuData = &_cpuData[cpu];
+  HyperVMessage *message = &cpuData->messages[kVMBusInterruptMessage];
+  UInt32        tail     = cpuData->messageQueueTail;
+
+  //
+  // If the queue is full, leave the message in the slot.
+  // Hyper-V will not deliver further messages until it is consumed.
+  //
+  if ((tail - cpuData->messageQueueHead) >= kHyperVMessageQueueLength) {
+    return false;
+  }
+  memcpy(&cpuData->messageQueue[tail % kHyperVMessageQueueLength], (const void*) message, sizeof (*message));
+
+  //
+  // Release the slot, and EOM if another message is pending.
+  // The slot is claimed atomically, as the work loop may be consuming it after a full queue.
+  // The pending flag must be read after the slot is cleared.
+  //
+  if (cpuData->messageQueue[tail % kHyperVMessageQueueLength].type == kHyperVMessageTypeNone
+      || !OSCompareAndSwap(cpuData->messageQueue[tail % kHyperVMessageQueueLength].type, kHyperVMessageTypeNone,
+                           (volatile UInt32*) &message->type)) {
+    return false;
+  }
+  __sync_synchronize();
+  cpuData->messageQueueTail = tail + 1;
+  if (message->flags.messagePending) {
+    wrmsr64(kHyperVMsrEom, 0);
+  }
+  return true;
+}
+
+bool HyperVController::dequeueSynICMessage(UInt32 cpu, HyperVMessage *message) {
+  HyperVCPUData *cpuData = &_cpuData[cpu];
+  UInt32        head     = cpuData->messageQueueHead;
+
+  if (head != cpuData->messageQueueTail) {
+    __sync_synchronize();
+    memcpy(message, &cpuData->messageQueue[head % kHyperVMessageQueueLength], sizeof (*message));
+    __sync_synchronize();
+    cpuData->messageQueueHead = head + 1;
+    return true;
+  }
+
+  //
+  // Queue was full when this message arrived, it is still in the slot and must be released from here.
+  // If the interrupt handler claimed it first, it will be in the queue instead.
+  //
+  if (cpuData->messages[kVMBusInterruptMessage].type != kHyperVMessageTypeNone) {
+    memcpy(message, (const void*) &cpuData->messages[kVMBusInterruptMessage], sizeof (*message));
+    if (message->type == kHyperVMessageTypeNone
+        || !OSCompareAndSwap(message->type, kHyperVMessageTypeNone, (volatile UInt32*) &cpuData->messages[kVMBusInterruptMessage].type)) {
+      return dequeueSynICMessage(cpu, message);
+    }
+
+    //
+    // The slot may already hold a new message, so it must not be cleared again.
+    // Use the pending flag from the copy, and from the slot in case it was set before the slot was released.
+    // An unneeded EOM is harmless.
+    //
+    __sync_synchronize();
+    if (message->flags.messagePending || cpuData->messages[kVMBusInterruptMessage].flags.messagePending) {
+      signalSynICEOM(cpu);
+    }
+    return true;
+  }
+  return false;
+}
+
 bool HyperVController::enableInterrupts(HyperVEventFlags *legacyEventFlags) {
   disableInterrupts();
 
@@ -318,7 +395,13 @@ void HyperVController::sendSynICEOM(UInt32 cpu) {
   if (!_cpuData[cpu].messages[kVMBusInterruptMessage].flags.messagePending) {
     return;
   }
-  
+  signalSynICEOM(cpu);
+}
+
+void HyperVController::signalSynICEOM(UInt32 cpu) {
+  //
+  // EOM must be sent on the CPU that owns the message slot.
+  //
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
   //
   // Change to desired CPU if needed.
@@ -356,3 +439,126 @@ void HyperVController::sendSynICEOM(UInt32 cpu) {
   mp_rendezvous_no_intrs(doAllCpuSyncICEOM, &cpu);
 #endif
 }
+
+void HyperVController::initSyntheticTimer() {
+  //
+  // Synthetic timer deadlines are in reference time.
+  //
+  if ((_hvFeatures & kHyperVCpuidMsrSynTimer) == 0 || !isTimeRefCounterSupported()) {
+    HVDBGLOG("Synthetic timers are not supported");
+    return;
+  }
+
+  _stimerLock = IOSimpleLockAlloc();
+  if (_stimerLock == nullptr) {
+    HVSYSLOG("Failed to allocate synthetic timer lock");
+    return;
+  }
+  _stimerDirectMode = (_hvFeatures3 & CPUID3_HV_STIMER_DIRECT) != 0;
+  HVDBGLOG("Synthetic timers are supported (direct mode: %s)", _stimerDirectMode ? "yes" : "no");
+}
+
+void HyperVController::programSyntheticTimer(UInt64 deadline) {
+  UInt64 config = kHyperVMsrSTimerConfigEnable;
+
+  //
+  // Must be called with the synthetic timer lock held and interrupts disabled, as the timer is per-processor.
+  // Direct mode raises the VMBus interrupt vector directly instead of posting a message to the timer SINT.
+  //
+  if (_stimerDirectMode) {
+    config |= kHyperVMsrSTimerConfigDirectMode
+              | (((UInt64) _interruptVector << kHyperVMsrSTimerConfigVectorShift) & kHyperVMsrSTimerConfigVectorMask);
+  } else {
+    config |= ((UInt64) kVMBusInterruptTimer << kHyperVMsrSTimerConfigSIntShift) & kHyperVMsrSTimerConfigSIntMask;
+  }
+
+  wrmsr64(kHyperVMsrSTimer0Config, config);
+  wrmsr64(kHyperVMsrSTimer0Count, deadline);
+  _stimerDeadline = deadline;
+}
+
+void HyperVController::handleSyntheticTimer() {
+  HyperVSyntheticTimer *timer;
+  UInt64               currentTime;
+  UInt64               nextDeadline = 0;
+
+  if (_stimerLock == nullptr) {
+    return;
+  }
+
+  IOSimpleLockLock(_stimerLock);
+
+  //
+  // A timer left armed on another processor may expire after a newer deadline was programmed, ignore it.
+  //
+  currentTime = readTimeRefCounter();
+  if (_stimerDeadline == 0 || currentTime < _stimerDeadline) {
+    IOSimpleLockUnlock(_stimerLock);
+    return;
+  }
+  _stimerDeadline = 0;
+
+  //
+  // Fire all expired timers and re-arm for the next deadline.
+  //
+  for (timer = _stimerList; timer != nullptr; timer = timer->_nextTimer) {
+    if (!timer->_isArmed) {
+      continue;
+    }
+
+    if (timer->_deadline <= currentTime) {
+      timer->_isArmed = false;
+      timer->timerFired();
+    } else if (nextDeadline == 0 || timer->_deadline < nextDeadline) {
+      nextDeadline = timer->_deadline;
+    }
+  }
+  if (nextDeadline != 0) {
+    programSyntheticTimer(nextDeadline);
+  }
+
+  IOSimpleLockUnlock(_stimerLock);
+}
+
+void HyperVController::registerSyntheticTimer(HyperVSyntheticTimer *timer) {
+  IOInterruptState intState = IOSimpleLockLockDisableInterrupt(_stimerLock);
+  timer->_nextTimer = _stimerList;
+  _stimerList       = timer;
+  IOSimpleLockUnlockEnableInterrupt(_stimerLock, intState);
+}
+
+void HyperVController::unregisterSyntheticTimer(HyperVSyntheticTimer *timer) {
+  IOInterruptState intState = IOSimpleLockLockDisableInterrupt(_stimerLock);
+  for (HyperVSyntheticTimer **timerLink = &_stimerList; *timerLink != nullptr; timerLink = &(*timerLink)->_nextTimer) {
+    if (*timerLink == timer) {
+      *timerLink = timer->_nextTimer;
+      break;
+    }
+  }
+  timer->_nextTimer = nullptr;
+  timer->_isArmed   = false;
+  IOSimpleLockUnlockEnableInterrupt(_stimerLock, intState);
+}
+
+void HyperVController::armSyntheticTimer(HyperVSyntheticTimer *timer, UInt64 deadline) {
+  IOInterruptState intState = IOSimpleLockLockDisableInterrupt(_stimerLock);
+  timer->_deadline = deadline;
+  timer->_isArmed  = true;
+
+  //
+  // Only reprogram the hardware timer if this deadline is earlier than the current one.
+  //
+  if (_stimerDeadline == 0 || deadline < _stimerDeadline) {
+    programSyntheticTimer(deadline);
+  }
+  IOSimpleLockUnlockEnableInterrupt(_stimerLock, intState);
+}
+
+void HyperVController::cancelSyntheticTimer(HyperVSyntheticTimer *timer) {
+  //
+  // Hardware timer is left armed, it will find nothing to fire once it expires.
+  //
+  IOInterruptState intState = IOSimpleLockLockDisableInterrupt(_stimerLock);
+  timer->_isArmed = false;
+  IOSimpleLockUnlockEnableInterrupt(_stimerLock, intState);
+}
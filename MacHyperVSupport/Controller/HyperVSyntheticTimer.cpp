@@ -0,0 +1,87 @@
+//
+//  HyperVSyntheticTimer.cpp
+//  Hyper-V synthetic timer event source
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVSyntheticTimer.hpp"
+#include "HyperVController.hpp"
+
+OSDefineMetaClassAndStructors(HyperVSyntheticTimer, super);
+
+HyperVSyntheticTimer *HyperVSyntheticTimer::timerEventSource(HyperVController *controller, OSObject *owner, Action action) {
+  HyperVSyntheticTimer *me = new HyperVSyntheticTimer;
+  if (me != nullptr && !me->init(controller, owner, action)) {
+    me->release();
+    return nullptr;
+  }
+  return me;
+}
+
+bool HyperVSyntheticTimer::init(HyperVController *controller, OSObject *owner, Action action) {
+  if (controller == nullptr || !controller->isSyntheticTimerSupported()) {
+    return false;
+  }
+  if (!super::init(owner, (IOEventSource::Action) action)) {
+    return false;
+  }
+  HVCheckDebugArgs();
+
+  _hvController = controller;
+  _hvController->retain();
+  _hvController->registerSyntheticTimer(this);
+  return true;
+}
+
+void HyperVSyntheticTimer::free() {
+  if (_hvController != nullptr) {
+    _hvController->unregisterSyntheticTimer(this);
+    OSSafeReleaseNULL(_hvController);
+  }
+  super::free();
+}
+
+void HyperVSyntheticTimer::disable() {
+  cancelTimeout();
+  super::disable();
+}
+
+IOReturn HyperVSyntheticTimer::setTimeoutUS(UInt32 microseconds) {
+  if (!enabled) {
+    return kIOReturnNotReady;
+  }
+
+  //
+  // Reference time is in 100ns units.
+  //
+  _hasFired = false;
+  _hvController->armSyntheticTimer(this, _hvController->readTimeRefCounter() + ((UInt64) microseconds * 10));
+  HVDBGLOG("Timer armed for %u us", microseconds);
+  return kIOReturnSuccess;
+}
+
+void HyperVSyntheticTimer::cancelTimeout() {
+  _hvController->cancelSyntheticTimer(this);
+  _hasFired = false;
+}
+
+void HyperVSyntheticTimer::timerFired() {
+  //
+  // Called from interrupt context, run the action on the work loop.
+  //
+  _hasFired = true;
+  signalWorkAvailable();
+}
+
+bool HyperVSyntheticTimer::checkForWork() {
+  if (!_hasFired) {
+    return false;
+  }
+  _hasFired = false;
+
+  if (enabled && action != nullptr) {
+    (*(Action) action)(owner, this);
+  }
+  return false;
+}
@@ -0,0 +1,65 @@
+//
+//  HyperVSyntheticTimer.hpp
+//  Hyper-V synthetic timer event source
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVSyntheticTimer_hpp
+#define HyperVSyntheticTimer_hpp
+
+#include <IOKit/IOEventSource.h>
+
+#include "HyperV.hpp"
+
+class HyperVController;
+
+//
+// One-shot timer event source backed by the Hyper-V synthetic timers.
+// Timeouts are tracked in 100ns reference time units, and the action is invoked on the work loop.
+//
+class HyperVSyntheticTimer : public IOEventSource {
+  OSDeclareDefaultStructors(HyperVSyntheticTimer);
+  HVDeclareLogFunctions("stimer");
+  typedef IOEventSource super;
+
+  friend class HyperVController;
+
+public:
+  typedef void (*Action)(OSObject *owner, HyperVSyntheticTimer *sender);
+
+private:
+  HyperVController      *_hvController = nullptr;
+
+  //
+  // Protected by the controller synthetic timer lock.
+  //
+  HyperVSyntheticTimer  *_nextTimer    = nullptr;
+  UInt64                _deadline      = 0;
+  bool                  _isArmed       = false;
+
+  volatile bool         _hasFired      = false;
+
+  void timerFired();
+
+protected:
+  //
+  // IOEventSource overrides.
+  //
+  bool checkForWork() APPLE_KEXT_OVERRIDE;
+  void free() APPLE_KEXT_OVERRIDE;
+
+public:
+  static HyperVSyntheticTimer *timerEventSource(HyperVController *controller, OSObject *owner, Action action);
+  bool init(HyperVController *controller, OSObject *owner, Action action);
+
+  //
+  // IOEventSource overrides.
+  //
+  void disable() APPLE_KEXT_OVERRIDE;
+
+  IOReturn setTimeoutUS(UInt32 microseconds);
+  void cancelTimeout();
+};
+
+#endif
@@ -39,6 +39,14 @@ bool HyperVNetwork::start(IOService *provider) {
   }
 
   do {
+    //
+    // Allocate statistics, these are updated from the packet handlers.
+    //
+    if (!allocateStatistics()) {
+      HVSYSLOG("Failed to allocate statistics");
+      break;
+    }
+
     //
     // Install packet handlers.
     //
@@ -47,6 +55,7 @@ bool HyperVNetwork::start(IOService *provider) {
       HVSYSLOG("Failed to install packet handlers with status 0x%X", status);
       break;
     }
+    _hvDevice->installPacketDrainAction(OSMemberFunctionCast(HyperVVMBusDevice::PacketDrainAction, this, &HyperVNetwork::handlePacketDrain));
 
 #if DEBUG
     _hvDevice->installTimerDebugPrintAction(this, OSMemberFunctionCast(HyperVVMBusDevice::TimerDebugAction, this, &HyperVNetwork::handleTimer));
@@ -61,9 +70,16 @@ bool HyperVNetwork::start(IOService *provider) {
       break;
     }
     
-    // TODO
-    rndisLock = IOLockAlloc();
+    //
+    // Allocate RNDIS control request slots.
+    //
+    if (!allocateRNDISRequests()) {
+      HVSYSLOG("Failed to allocate RNDIS requests");
+      break;
+    }
+
     connectNetwork();
+    configureRxBusyPoll();
     
     //
     // Attach and register network interface.
@@ -93,95 +109,452 @@ void HyperVNetwork::stop(IOService *provider) {
   }
 
   if (_hvDevice != nullptr) {
+    cancelReceiveLoans();
     _hvDevice->closeVMBusChannel();
     _hvDevice->uninstallPacketActions();
+    freeRNDISRequests();
     OSSafeReleaseNULL(_hvDevice);
   }
 
   super::stop(provider);
 }
 
+void HyperVNetwork::free() {
+  freeReceiveLoans();
+  freeStatistics();
+  super::free();
+}
+
 IOReturn HyperVNetwork::getHardwareAddress(IOEthernetAddress *addrP) {
   *addrP = _ethAddress;
   return kIOReturnSuccess;
 }
 
+bool HyperVNetwork::configureInterface(IONetworkInterface *interface) {
+  IONetworkData *netData;
+
+  if (!super::configureInterface(interface)) {
+    HVSYSLOG("super::configureInterface() returned false");
+    return false;
+  }
+
+  //
+  // Get statistics structures from interface.
+  //
+  netData = interface->getParameter(kIONetworkStatsKey);
+  if (netData == nullptr || (_networkStats = (IONetworkStats *)netData->getBuffer()) == nullptr) {
+    HVSYSLOG("Failed to get network statistics");
+    return false;
+  }
+
+  //
+  // Statistics are kept per-CPU, aggregate them whenever they are read.
+  //
+  netData->setNotificationTarget(this, &HyperVNetwork::handleStatisticsAccess);
+
+  netData = interface->getParameter(kIOEthernetStatsKey);
+  if (netData == nullptr || (_ethernetStats = (IOEthernetStats *)netData->getBuffer()) == nullptr) {
+    HVSYSLOG("Failed to get Ethernet statistics");
+    return false;
+  }
+
+  return true;
+}
+
+UInt32 HyperVNetwork::getFeatures() const {
+  //
+  // VLAN tags are inserted and stripped by the host using per-packet info.
+  //
+  return _isVlanSupported ? kIONetworkFeatureHardwareVlan : 0;
+}
+
+IOReturn HyperVNetwork::getMaxPacketSize(UInt32 *maxSize) const {
+  //
+  // Max packet size includes the Ethernet header and CRC.
+  //
+  *maxSize = _maxMtu + (kIOEthernetMaxPacketSize - kHyperVNetworkMTUDefault);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::setMaxPacketSize(UInt32 maxSize) {
+  UInt32 mtu;
+
+  if (maxSize <= (kIOEthernetMaxPacketSize - kHyperVNetworkMTUDefault)) {
+    return kIOReturnBadArgument;
+  }
+
+  mtu = maxSize - (kIOEthernetMaxPacketSize - kHyperVNetworkMTUDefault);
+  if (mtu > _maxMtu) {
+    HVDBGLOG("MTU of %u bytes is larger than max of %u bytes", mtu, _maxMtu);
+    return kIOReturnUnsupported;
+  }
+
+  //
+  // Host accepts frames up to the MTU configured during connection, nothing else needs to be changed.
+  //
+  HVDBGLOG("MTU changed to %u bytes", mtu);
+  _currentMtu = mtu;
+  return kIOReturnSuccess;
+}
+
+IOOutputQueue* HyperVNetwork::createOutputQueue() {
+  //
+  // Use a gated queue on the VMBus device work loop.
+  // Transmits are then serialized with send completions, which restart the queue after a stall.
+  //
+  _outputQueue = IOGatedOutputQueue::withTarget(this, getWorkLoop(), kHyperVNetworkTransmitQueueSize);
+  if (_outputQueue == nullptr) {
+    HVSYSLOG("Failed to create output queue");
+  }
+  return _outputQueue;
+}
+
 UInt32 HyperVNetwork::outputPacket(mbuf_t m, void *param) {
-  IOReturn status;
-  size_t   packetLength;
-  UInt32   sendIndex;
+  IOReturn              status;
+  size_t                packetLength;
+  UInt32                rndisLength;
+  HyperVNetworkCPUStats *cpuStats;
 
-  UInt8                     *rndisBuffer;
-  HyperVNetworkRNDISMessage *rndisMsg;
-  HyperVNetworkMessage      netMsg;
+  packetLength = mbuf_pkthdr_len(m);
+  if (packetLength == 0 || packetLength > kHyperVNetworkTransmitMaxPacketSize) {
+    HVSYSLOG("Packet of %u bytes is too large or invalid", packetLength);
+    OSIncrementAtomic64((SInt64 *)&getCPUStats()->txErrors);
+    freePacket(m);
+    return kIOReturnOutputDropped;
+  }
 
   //
-  // Get next available send section.
+  // Ensure there is space in the ring buffer.
+  // Queue is stalled until a send completion frees up resources.
   //
-  sendIndex = getNextSendIndex();
-  if (sendIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
-    HVSYSLOG("No more send sections available, unable to send packet");
+  if (!isTxRingAvailable()) {
+    HVDBGLOG("Ring buffer is full, stalling output queue");
+    OSIncrementAtomic64((SInt64 *)&getCPUStats()->txStalls);
+    _isTxStalled = true;
     return kIOReturnOutputStall;
   }
 
   //
-  // Create RNDIS data request used for transmitting packet.
+  // Small packets are copied into a send section.
+  // Larger packets, and packets that do not fit in a section, are sent directly from the mbuf pages.
   //
-  packetLength = mbuf_pkthdr_len(m);
-  rndisBuffer  = &_sendBuffer.buffer[_sendSectionSize * sendIndex];
-  rndisMsg     = (HyperVNetworkRNDISMessage *)rndisBuffer;
-  bzero(rndisMsg, sizeof (*rndisMsg));
+  rndisLength = kHyperVNetworkRNDISDataPacketMaxHeaderLength + (UInt32)packetLength;
+  if (packetLength <= kHyperVNetworkTransmitCopyMaxSize && rndisLength <= _sendSectionSize) {
+    status = transmitPacketCopy(m, (UInt32)packetLength);
+  } else {
+    status = transmitPacketGPADirect(m, (UInt32)packetLength);
+  }
+
+  cpuStats = getCPUStats();
+  if (status == kIOReturnBadArgument) {
+    OSIncrementAtomic64((SInt64 *)&cpuStats->txErrors);
+    freePacket(m);
+    return kIOReturnOutputDropped;
+  } else if (status != kIOReturnSuccess) {
+    HVDBGLOG("Failed to send packet with status 0x%X, stalling output queue", status);
+    OSIncrementAtomic64((SInt64 *)&cpuStats->txStalls);
+    _isTxStalled = true;
+    return kIOReturnOutputStall;
+  }
+  OSIncrementAtomic64((SInt64 *)&cpuStats->txPackets);
+  OSAddAtomic64(packetLength, (SInt64 *)&cpuStats->txBytes);
+
+  //
+  // Packet is freed on drop, and either once copied or once the send completes.
+  // Output queue will retry the packet on a stall.
+  //
+  return kIOReturnOutputSuccess;
+}
+
+void HyperVNetwork::initRNDISDataPacket(HyperVNetworkRNDISMessage *rndisMsg, UInt32 packetLength, mbuf_t m) {
+  HyperVNetworkRNDISPerPacketInfo          *perPacketInfo;
+  HyperVNetworkRNDISPerPacketInfoIEEE8021Q *vlanInfo;
+  UInt32                                   vlanTag;
+
+  bzero(rndisMsg, sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket));
 
   rndisMsg->header.type           = kHyperVNetworkRNDISMessageTypePacket;
   rndisMsg->dataPacket.dataOffset = sizeof (rndisMsg->dataPacket);
-  rndisMsg->dataPacket.dataLength = (UInt32)packetLength;
-  rndisMsg->header.length         = sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket) + rndisMsg->dataPacket.dataLength;
+  rndisMsg->dataPacket.dataLength = packetLength;
 
-  if (packetLength == 0 || rndisMsg->header.length > _sendSectionSize) {
-    HVSYSLOG("Packet of %u bytes is too large or invalid, send section size is %u bytes", packetLength, _sendSectionSize);
-    return kIOReturnOutputDropped;
+  //
+  // Add 802.1Q per-packet info if the stack requested a VLAN tag to be inserted.
+  // Packet data follows the per-packet info.
+  //
+  if (_isVlanSupported && getVlanTagDemand(m, &vlanTag)) {
+    rndisMsg->dataPacket.perPacketInfoOffset = sizeof (rndisMsg->dataPacket);
+    rndisMsg->dataPacket.perPacketInfoLength = sizeof (*perPacketInfo) + sizeof (*vlanInfo);
+    rndisMsg->dataPacket.dataOffset         += rndisMsg->dataPacket.perPacketInfoLength;
+
+    perPacketInfo = (HyperVNetworkRNDISPerPacketInfo *)(((UInt8 *)&rndisMsg->dataPacket) + rndisMsg->dataPacket.perPacketInfoOffset);
+    perPacketInfo->size                = rndisMsg->dataPacket.perPacketInfoLength;
+    perPacketInfo->type                = kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q;
+    perPacketInfo->perPacketInfoOffset = sizeof (*perPacketInfo);
+
+    vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *)(((UInt8 *)perPacketInfo) + perPacketInfo->perPacketInfoOffset);
+    vlanInfo->value    = 0;
+    vlanInfo->vlanId   = vlanTag & kHyperVNetworkVlanTagIdMask;
+    vlanInfo->cfi      = (vlanTag >> kHyperVNetworkVlanTagCFIShift) & 0x1;
+    vlanInfo->priority = (vlanTag >> kHyperVNetworkVlanTagPriorityShift) & 0x7;
   }
 
+  rndisMsg->header.length = sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset + rndisMsg->dataPacket.dataLength;
+}
+
+IOReturn HyperVNetwork::transmitPacketCopy(mbuf_t m, UInt32 packetLength) {
+  IOReturn                  status;
+  UInt32                    sendIndex;
+  UInt32                    rndisLength;
+  UInt32                    rndisOffset = 0;
+  UInt8                     *sectionBuffer;
+  UInt8                     *rndisBuffer;
+  HyperVNetworkRNDISMessage *rndisMsg;
+
+  rndisLength = kHyperVNetworkRNDISDataPacketMaxHeaderLength + packetLength;
+
   //
-  // Copy packet data to send section.
+  // Send the open aggregate first if this packet will not fit in it.
   //
-  rndisBuffer += sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset;
+  if (_txAggregateIndex != kHyperVNetworkRNDISSendSectionIndexInvalid) {
+    rndisOffset = (_txAggregateLength + (_txAggregateAlignment - 1)) & ~(_txAggregateAlignment - 1);
+    if (_txAggregateCount >= _txAggregateMaxPackets || (rndisOffset + rndisLength) > _txAggregateMaxLength) {
+      status = flushTransmitAggregate();
+      if (status != kIOReturnSuccess) {
+        return status;
+      }
+    }
+  }
+
+  if (_txAggregateIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
+    //
+    // Start a new aggregate in the next available send section.
+    //
+    sendIndex = getNextSendIndex();
+    if (sendIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
+      HVDBGLOG("No more send sections available");
+      return kIOReturnNoResources;
+    }
+
+    _txAggregateIndex      = sendIndex;
+    _txAggregateLength     = 0;
+    _txAggregateLastOffset = 0;
+    _txAggregateCount      = 0;
+    rndisOffset            = 0;
+    sectionBuffer          = &_sendBuffer.buffer[_sendSectionSize * _txAggregateIndex];
+  } else {
+    //
+    // Pad the previous RNDIS packet so this one starts at the required alignment.
+    //
+    sectionBuffer = &_sendBuffer.buffer[_sendSectionSize * _txAggregateIndex];
+    rndisMsg      = (HyperVNetworkRNDISMessage *)&sectionBuffer[_txAggregateLastOffset];
+    bzero(&sectionBuffer[_txAggregateLength], rndisOffset - _txAggregateLength);
+    rndisMsg->header.length += rndisOffset - _txAggregateLength;
+  }
+
+  //
+  // Create RNDIS data packet and copy packet data after it.
+  //
+  rndisMsg = (HyperVNetworkRNDISMessage *)&sectionBuffer[rndisOffset];
+  initRNDISDataPacket(rndisMsg, packetLength, m);
+
+  rndisBuffer = ((UInt8 *)rndisMsg) + sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset;
   for (mbuf_t pktCurrent = m; pktCurrent != nullptr; pktCurrent = mbuf_next(pktCurrent)) {
     size_t pktCurrentLength = mbuf_len(pktCurrent);
     memcpy(rndisBuffer, mbuf_data(pktCurrent), pktCurrentLength);
     rndisBuffer += pktCurrentLength;
   }
+  freePacket(m);
+
+  _txAggregateLastOffset = rndisOffset;
+  _txAggregateLength     = rndisOffset + rndisMsg->header.length;
+  _txAggregateCount++;
+  HVDBGLOG("Added packet of %u bytes to send section %u/%u (%u packets, %u bytes)",
+           packetLength, _txAggregateIndex, _sendSectionCount, _txAggregateCount, _txAggregateLength);
+
+  //
+  // Send the aggregate once it is full, or there are no more packets waiting.
+  // If this fails, the aggregate is sent once the output queue is restarted.
+  //
+  if (_txAggregateCount >= _txAggregateMaxPackets || _outputQueue == nullptr || _outputQueue->getSize() == 0) {
+    flushTransmitAggregate();
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::transmitPacketGPADirect(mbuf_t m, UInt32 packetLength) {
+  IOReturn                  status;
+  UInt32                    sendIndex;
+  IOPhysicalSegment         segments[kHyperVNetworkTransmitMaxSegments];
+  UInt32                    segmentCount;
+  VMBusSinglePageBuffer     pageBuffers[kVMBusMaxPageBufferCount];
+  UInt32                    pageBufferCount = 0;
+  UInt32                    rndisHeaderLength;
+  UInt32                    rndisOffset;
+  UInt32                    pageLength;
+  HyperVNetworkRNDISMessage *rndisMsg;
+  HyperVNetworkMessage      netMsg;
+
+  //
+  // Packets must be sent in order, send any aggregated packets first.
+  //
+  status = flushTransmitAggregate();
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+
+  //
+  // Get physical pages of the packet, coalescing the mbuf chain if it has too many segments.
+  //
+  segmentCount = _txMbufCursor->getPhysicalSegmentsWithCoalesce(m, segments, kHyperVNetworkTransmitMaxSegments);
+  if (segmentCount == 0) {
+    HVSYSLOG("Failed to get physical segments for packet of %u bytes", packetLength);
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // RNDIS data packet is placed in a send section, which also tracks the packet until completion.
+  //
+  sendIndex = getNextSendIndex();
+  if (sendIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
+    HVDBGLOG("No more send sections available");
+    return kIOReturnNoResources;
+  }
+  rndisMsg = (HyperVNetworkRNDISMessage *)&_sendBuffer.buffer[_sendSectionSize * sendIndex];
+  initRNDISDataPacket(rndisMsg, packetLength, m);
+
+  //
+  // First page buffer(s) describe the RNDIS header in the send section, followed by the packet itself.
+  // Send buffer may not be physically contiguous, add each page of the header separately.
+  //
+  rndisHeaderLength = sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset;
+  rndisOffset       = _sendSectionSize * sendIndex;
+  while (rndisHeaderLength > 0) {
+    pageLength = PAGE_SIZE - (rndisOffset & PAGE_MASK);
+    if (pageLength > rndisHeaderLength) {
+      pageLength = rndisHeaderLength;
+    }
+    if (!addTransmitPageBuffers(pageBuffers, &pageBufferCount,
+                                _hvDevice->getHvController()->getDmaBufferPhysAddr(&_sendBuffer, rndisOffset), pageLength)) {
+      releaseSendIndex(sendIndex);
+      return kIOReturnBadArgument;
+    }
+    rndisOffset       += pageLength;
+    rndisHeaderLength -= pageLength;
+  }
+  for (UInt32 i = 0; i < segmentCount; i++) {
+    if (!addTransmitPageBuffers(pageBuffers, &pageBufferCount, segments[i].location, (UInt32)segments[i].length)) {
+      HVSYSLOG("Packet of %u bytes has too many page buffers", packetLength);
+      releaseSendIndex(sendIndex);
+      return kIOReturnBadArgument;
+    }
+  }
 
   //
-  // Create and send packet for sending the RNDIS data packet.
+  // Send buffer is not used for the packet data.
   //
   bzero(&netMsg, sizeof (netMsg));
   netMsg.messageType                               = kHyperVNetworkMessageTypeV1SendRNDISPacket;
   netMsg.v1.sendRNDISPacket.channelType            = kHyperVNetworkRNDISChannelTypeData;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = sendIndex;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionSize  = rndisMsg->header.length;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = kHyperVNetworkRNDISSendSectionIndexInvalid;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionSize  = 0;
 
-  HVDBGLOG("Preparing to send packet of %u bytes using send section %u/%u", rndisMsg->header.length, sendIndex, _sendSectionCount);
-  status = _hvDevice->writeInbandPacketWithTransactionId(&netMsg, sizeof (netMsg), sendIndex | kHyperVNetworkSendTransIdBits, true);
+  HVDBGLOG("Preparing to send packet of %u bytes using %u page buffers (send section %u/%u)",
+           rndisMsg->header.length, pageBufferCount, sendIndex, _sendSectionCount);
+  _sendPackets[sendIndex] = m;
+  status = _hvDevice->writeGPADirectSinglePagePacket(&netMsg, sizeof (netMsg), true, pageBuffers, pageBufferCount,
+                                                     nullptr, 0, sendIndex | kHyperVNetworkSendTransIdBits);
   if (status != kIOReturnSuccess) {
-    HVSYSLOG("Failed to send packet with status 0x%X", status);
-    return kIOReturnOutputStall;
+    _sendPackets[sendIndex] = nullptr;
+    releaseSendIndex(sendIndex);
+  }
+  return status;
+}
+
+IOReturn HyperVNetwork::flushTransmitAggregate() {
+  IOReturn             status;
+  HyperVNetworkMessage netMsg;
+
+  if (_txAggregateIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
+    return kIOReturnSuccess;
   }
 
   //
-  // Packet is only to be freed on success.
-  // Caller is responsible in all other cases.
+  // Create and send packet for sending all RNDIS data packets in the send section.
   //
-  freePacket(m);
-  return kIOReturnOutputSuccess;
+  bzero(&netMsg, sizeof (netMsg));
+  netMsg.messageType                               = kHyperVNetworkMessageTypeV1SendRNDISPacket;
+  netMsg.v1.sendRNDISPacket.channelType            = kHyperVNetworkRNDISChannelTypeData;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = _txAggregateIndex;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionSize  = _txAggregateLength;
+
+  HVDBGLOG("Sending %u packets of %u bytes using send section %u/%u",
+           _txAggregateCount, _txAggregateLength, _txAggregateIndex, _sendSectionCount);
+  status = _hvDevice->writeInbandPacketWithTransactionId(&netMsg, sizeof (netMsg), _txAggregateIndex | kHyperVNetworkSendTransIdBits, true);
+  if (status != kIOReturnSuccess) {
+    //
+    // Packets have already been accepted, keep the aggregate and retry once the output queue is restarted.
+    //
+    HVDBGLOG("Failed to send aggregated packets with status 0x%X", status);
+    _isTxStalled = true;
+    return status;
+  }
+
+  _txAggregateIndex = kHyperVNetworkRNDISSendSectionIndexInvalid;
+  return kIOReturnSuccess;
 }
 
 IOReturn HyperVNetwork::enable(IONetworkInterface *interface) {
   _isNetworkEnabled = true;
+  _isTxStalled      = false;
+  updatePacketFilter();
+  if (_rxBusyPollUS != 0) {
+    _hvDevice->enableRxBusyPoll(_rxBusyPollUS);
+  }
+
+  if (_outputQueue != nullptr) {
+    _outputQueue->setCapacity(kHyperVNetworkTransmitQueueSize);
+    _outputQueue->start();
+  }
   return kIOReturnSuccess;
 }
 
 IOReturn HyperVNetwork::disable(IONetworkInterface *interface) {
   _isNetworkEnabled = false;
+  updatePacketFilter();
+  _hvDevice->disableRxPolling();
+  _hvDevice->disableRxBusyPoll();
+  flushTransmitAggregate();
+
+  if (_outputQueue != nullptr) {
+    _outputQueue->stop();
+    _outputQueue->setCapacity(0);
+    _outputQueue->flush();
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::setPromiscuousMode(bool active) {
+  _isPromiscuous = active;
+  updatePacketFilter();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::setMulticastMode(bool active) {
+  _isMulticastEnabled = active;
+  updatePacketFilter();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::setMulticastList(IOEthernetAddress *addrs, UInt32 count) {
+  //
+  // Save the list if it fits, otherwise all multicast traffic is received.
+  //
+  _multicastListCount = count;
+  if (count <= _multicastListMax && count > 0) {
+    memcpy(_multicastList, addrs, sizeof (_multicastList[0]) * count);
+  }
+
+  HVDBGLOG("Multicast list changed to %u addresses", count);
+  updatePacketFilter();
   return kIOReturnSuccess;
 }
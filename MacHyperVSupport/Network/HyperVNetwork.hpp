@@ -13,6 +13,7 @@
 #include <IOKit/network/IOEthernetInterface.h>
 #include <IOKit/network/IOMbufMemoryCursor.h>
 #include <IOKit/network/IONetworkMedium.h>
+#include <IOKit/network/IOGatedOutputQueue.h>
 #include <IOKit/network/IOOutputQueue.h>
 
 #include "HyperVVMBusDevice.hpp"
@@ -20,19 +21,75 @@
 
 extern "C" {
 #include <sys/kpi_mbuf.h>
+#include <pexpert/pexpert.h>
 }
 
+class HyperVNetwork;
+
+//
+// RNDIS control request completion action.
+// Response message is only valid for the duration of the call.
+//
+typedef void (HyperVNetwork::*HyperVNetworkRNDISAction)(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context);
+
+//
+// RNDIS control request slot.
+// The message buffer is a single DMA page, the response is copied back into it.
+//
 typedef struct HyperVNetworkRNDISRequest {
-  HyperVNetworkRNDISMessage message;
-  UInt8                     messageOverflow[PAGE_SIZE];
-  
-  HyperVNetworkRNDISRequest *next;
-  IOLock                    *lock;
-  bool                      isSleeping;
-  
+  HyperVNetworkRNDISMessage *message;
   HyperVDMABuffer           dmaBuffer;
+
+  UInt32                    requestId;
+  bool                      isActive;
+  bool                      isSent;
+  bool                      isComplete;
+  UInt64                    deadline;
+
+  HyperVNetworkRNDISAction  action;
+  void                      *context;
 } HyperVNetworkRNDISRequest;
 
+//
+// Tracks receive buffer ranges loaned to the network stack.
+// The completion for the transfer pages packet is held until all mbufs are freed.
+//
+typedef struct HyperVNetworkReceiveLoan {
+  HyperVNetwork            *network;
+  UInt64                   transactionId;
+  volatile SInt32          refCount;
+
+  HyperVNetworkReceiveLoan *next;
+} HyperVNetworkReceiveLoan;
+
+//
+// Per-CPU packet statistics.
+// Aggregated into the interface statistics when they are read.
+//
+typedef struct HyperVNetworkCPUStats {
+  volatile UInt64 rxPackets;
+  volatile UInt64 rxBytes;
+  volatile UInt64 rxErrors;
+  volatile UInt64 rxNoBuffers;
+  volatile UInt64 txPackets;
+  volatile UInt64 txBytes;
+  volatile UInt64 txErrors;
+  volatile UInt64 txStalls;
+} __attribute__((aligned(kHyperVNetworkStatsCacheLineSize))) HyperVNetworkCPUStats;
+
+//
+// Host statistics OIDs.
+//
+typedef enum {
+  kHyperVNetworkHostStatTransmitOk = 0,
+  kHyperVNetworkHostStatReceiveOk,
+  kHyperVNetworkHostStatTransmitError,
+  kHyperVNetworkHostStatReceiveError,
+  kHyperVNetworkHostStatReceiveNoBuffer,
+
+  kHyperVNetworkHostStatCount
+} HyperVNetworkHostStat;
+
 class HyperVNetwork : public IOEthernetController {
   OSDeclareDefaultStructors(HyperVNetwork);
   HVDeclareLogFunctionsVMBusChild("net");
@@ -50,6 +107,9 @@ private:
   IOEthernetAddress            _ethAddress       = { };
   bool                         _isLinkUp         = false;
   IONetworkMedium              *_networkMedium   = nullptr;
+  UInt32                       _maxMtu           = kHyperVNetworkMTUDefault;
+  UInt32                       _currentMtu       = kHyperVNetworkMTUDefault;
+  bool                         _isVlanSupported  = false;
 
   //
   // Receive buffer.
@@ -57,6 +117,38 @@ private:
   HyperVDMABuffer _receiveBuffer      = { };
   UInt32          _receiveBufferSize  = 0;
   UInt32          _receiveGpadlHandle = kHyperVGpadlNullHandle;
+  HyperVNetworkV1MessageReceiveBufferSection _receiveSections[kHyperVNetworkReceiveSectionMax] = { };
+  UInt32          _receiveSectionCount = 0;
+
+  //
+  // Receive buffer loans for zero-copy receive.
+  //
+  HyperVNetworkReceiveLoan *_receiveLoans            = nullptr;
+  HyperVNetworkReceiveLoan *_receiveLoanFreeList     = nullptr;
+  HyperVNetworkReceiveLoan *_receiveLoanCompleteList = nullptr;
+  IOSimpleLock             *_receiveLoanLock         = nullptr;
+  IOInterruptEventSource   *_receiveLoanEventSource  = nullptr;
+  bool                     _isReceiveLoanCancelled   = false;
+  volatile SInt32          _receiveLoanedBytes       = 0;
+  SInt32                   _receiveLoanMaxBytes      = 0;
+
+  //
+  // Adaptive receive interrupt moderation.
+  //
+  UInt32                   _rxModerationPackets  = 0;
+  UInt64                   _rxModerationStart    = 0;
+  UInt32                   _rxBusyPollUS         = 0;
+
+  //
+  // Interface statistics.
+  //
+  IONetworkStats           *_networkStats        = nullptr;
+  IOEthernetStats          *_ethernetStats       = nullptr;
+  HyperVNetworkCPUStats    *_cpuStats            = nullptr;
+  UInt32                   _cpuStatsCount        = 0;
+  UInt64                   _hostStats[kHyperVNetworkHostStatCount] = { };
+  UInt32                   _hostStatsPending     = 0;
+  UInt64                   _hostStatsLastUpdate  = 0;
 
   //
   // Send buffer and tracking info.
@@ -68,19 +160,54 @@ private:
   UInt32          _sendSectionCount       = 0;
   UInt32          *_sendIndexMap          = nullptr;
   size_t          _sendIndexMapSize       = 0;
+  UInt32          _sendIndexMapHint       = 0;
   UInt32          _sendIndexesOutstanding = 0;
-  UInt32                        oldSends = 0;
-  UInt64    totalbytes = 0;
-  UInt64    totalRX = 0;
-  UInt64 preCycle = 0;
-  UInt64 midCycle = 0;
-  UInt64 postCycle = 0;
-  UInt64 stalls = 0;
-  
-  IOLock                        *rndisLock = NULL;
-  UInt32                        rndisTransId = 0;
-  
-  HyperVNetworkRNDISRequest     *rndisRequests;
+
+  //
+  // Transmit queue.
+  //
+  IOOutputQueue   *_outputQueue           = nullptr;
+  bool            _isTxStalled            = false;
+
+  //
+  // GPA direct transmit.
+  // Packets sent directly are held by their send section until completion.
+  //
+  IOMbufNaturalMemoryCursor *_txMbufCursor = nullptr;
+  mbuf_t                    *_sendPackets  = nullptr;
+
+  //
+  // Transmit aggregation.
+  // Small packets are packed into an open send section until it is full or the output queue is empty.
+  //
+  UInt32 _txAggregateIndex       = kHyperVNetworkRNDISSendSectionIndexInvalid;
+  UInt32 _txAggregateLength      = 0;
+  UInt32 _txAggregateLastOffset  = 0;
+  UInt32 _txAggregateCount       = 0;
+  UInt32 _txAggregateMaxPackets  = 1;
+  UInt32 _txAggregateMaxLength   = 0;
+  UInt32 _txAggregateAlignment   = 1;
+
+  //
+  // Packet filter and multicast list.
+  // Changes are programmed using asynchronous RNDIS requests on the work loop, only one update is in flight at a time.
+  //
+  bool              _isPromiscuous          = false;
+  bool              _isMulticastEnabled     = false;
+  IOEthernetAddress _multicastList[kHyperVNetworkMulticastListMax];
+  UInt32            _multicastListCount     = 0;
+  UInt32            _multicastListMax       = 0;
+  bool              _isPacketFilterUpdating = false;
+  bool              _isPacketFilterPending  = false;
+
+  //
+  // RNDIS control requests.
+  //
+  HyperVNetworkRNDISRequest     *_rndisRequests     = nullptr;
+  IOLock                        *_rndisLock         = nullptr;
+  UInt32                        _rndisGeneration    = 0;
+  IOTimerEventSource            *_rndisTimerSource  = nullptr;
+  bool                          _isRNDISTimerArmed  = false;
   
 
   
@@ -89,46 +216,105 @@ private:
   void handleTimer();
   bool wakePacketHandler(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
   void handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
+  void handlePacketDrain();
+  void updateRxModeration();
+  void configureRxBusyPoll();
   
   
   bool negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion);
+  bool sendNDISConfig(UInt32 mtu, UInt64 capabilities);
   
   //
   // Send/receive buffers.
   //
+  void readBufferSizes();
   IOReturn initSendReceiveBuffers();
   void freeSendReceiveBuffers();
   UInt32 getNextSendIndex();
   UInt32 getFreeSendIndexCount();
   void releaseSendIndex(UInt32 sendIndex);
+  bool isTxRingAvailable();
+  void restartOutputQueue();
+  bool addTransmitPageBuffers(VMBusSinglePageBuffer *pageBuffers, UInt32 *pageBufferCount, UInt64 physAddr, UInt32 length);
+  void initRNDISDataPacket(HyperVNetworkRNDISMessage *rndisMsg, UInt32 packetLength, mbuf_t m);
+  IOReturn transmitPacketCopy(mbuf_t m, UInt32 packetLength);
+  IOReturn transmitPacketGPADirect(mbuf_t m, UInt32 packetLength);
+  IOReturn flushTransmitAggregate();
   
   bool connectNetwork();
   
   void handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 pktLength);
   void handleCompletion(void *pktData, UInt32 pktLength);
 
-  bool processRNDISPacket(UInt8 *data, UInt32 dataLength);
-  void processIncoming(UInt8 *data, UInt32 dataLength);
+  void sendReceiveCompletion(UInt64 transactionId);
+
+  bool processRNDISPacket(UInt8 *data, UInt32 dataLength, HyperVNetworkReceiveLoan *receiveLoan);
+  void processIncoming(UInt8 *data, UInt32 dataLength, HyperVNetworkReceiveLoan *receiveLoan);
+  bool getRNDISVlanTag(HyperVNetworkRNDISMessage *rndisPkt, UInt32 *vlanTag);
+
+  //
+  // Zero-copy receive.
+  //
+  bool allocateReceiveLoans();
+  void freeReceiveLoans();
+  HyperVNetworkReceiveLoan *getReceiveLoan(UInt64 transactionId);
+  void releaseReceiveLoan(HyperVNetworkReceiveLoan *receiveLoan);
+  void recycleReceiveLoan(HyperVNetworkReceiveLoan *receiveLoan);
+  void handleReceiveLoanCompletions(IOInterruptEventSource *sender, int count);
+  void cancelReceiveLoans();
+  void cancelReceiveLoansGated();
+  mbuf_t loanReceivePacket(UInt8 *pktData, UInt32 pktLength, HyperVNetworkReceiveLoan *receiveLoan);
+  static void freeReceiveLoanPacket(caddr_t buffer, u_int size, caddr_t arg);
   
   //
   // RNDIS setup and operations.
   //
+  bool allocateRNDISRequests();
+  void freeRNDISRequests();
   HyperVNetworkRNDISRequest *allocateRNDISRequest(size_t additionalLength = 0);
   void freeRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest);
-  UInt32 getNextRNDISTransId();
-  bool sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, bool waitResponse = false);
-  
+  IOReturn sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, HyperVNetworkRNDISAction action = nullptr, void *context = nullptr);
+  IOReturn waitRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest);
+  void completeRNDISRequest(HyperVNetworkRNDISMessage *rndisResponse, UInt32 responseLength);
+  void handleRNDISTimeout(IOTimerEventSource *sender);
+
   bool initializeRNDIS();
+  HyperVNetworkRNDISRequest *createRNDISGetOIDRequest(HyperVNetworkRNDISOID oid);
+  HyperVNetworkRNDISRequest *createRNDISSetOIDRequest(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize);
   IOReturn getRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize);
   IOReturn setRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize);
+  IOReturn getRNDISOIDAsync(HyperVNetworkRNDISOID oid, HyperVNetworkRNDISAction action, void *context = nullptr);
+  IOReturn setRNDISOIDAsync(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize,
+                            HyperVNetworkRNDISAction action, void *context = nullptr);
   
+  //
+  // Statistics.
+  //
+  bool allocateStatistics();
+  void freeStatistics();
+  inline HyperVNetworkCPUStats *getCPUStats() {
+    return &_cpuStats[cpu_number() % _cpuStatsCount];
+  }
+  void collectStatistics();
+  static IOReturn handleStatisticsAccess(void *target, void *param, IONetworkData *data, UInt32 accessType,
+                                         void *buffer, UInt32 *bufferSize, UInt32 offset);
+  void updateStatisticsGated();
+  void updateHostStatistics();
+  void handleHostStatistic(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context);
+  void publishHostStatistics();
+
   //
   // Private
   //
   void addNetworkMedium(UInt32 index, UInt32 type, UInt32 speed);
   void createMediumDictionary();
   bool readMACAddress();
+  void readMaximumFrameSize();
   void updateLinkState(HyperVNetworkRNDISMessageIndicateStatus *indicateStatus);
+  void readMulticastListSize();
+  void updatePacketFilter();
+  void handleMulticastListSet(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context);
+  void handlePacketFilterSet(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context);
   
 public:
   //
@@ -136,13 +322,24 @@ public:
   //
   bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
   void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
-  
+  void free() APPLE_KEXT_OVERRIDE;
+
   //
   // IOEthernetController overrides.
   //
   IOReturn getHardwareAddress(IOEthernetAddress *addrP) APPLE_KEXT_OVERRIDE;
+  bool configureInterface(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
   
+  UInt32 getFeatures() const APPLE_KEXT_OVERRIDE;
+  IOReturn getMaxPacketSize(UInt32 *maxSize) const APPLE_KEXT_OVERRIDE;
+  IOReturn setMaxPacketSize(UInt32 maxSize) APPLE_KEXT_OVERRIDE;
+
+  IOOutputQueue* createOutputQueue() APPLE_KEXT_OVERRIDE;
   UInt32 outputPacket(mbuf_t m, void *param) APPLE_KEXT_OVERRIDE;
+
+  IOReturn setPromiscuousMode(bool active) APPLE_KEXT_OVERRIDE;
+  IOReturn setMulticastMode(bool active) APPLE_KEXT_OVERRIDE;
+  IOReturn setMulticastList(IOEthernetAddress *addrs, UInt32 count) APPLE_KEXT_OVERRIDE;
   
   virtual IOReturn enable(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
   virtual IOReturn disable(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
@@ -8,18 +8,34 @@
 #include "HyperVNetwork.hpp"
 
 void HyperVNetwork::handleTimer() {
-  HVSYSLOG("Outstanding sends %u bytes %X %X %X stalls %llu", _sendIndexesOutstanding, preCycle, midCycle, postCycle, stalls);
+  collectStatistics();
+  HVSYSLOG("Outstanding sends %u, packets in %u out %u, errors in %u out %u",
+           _sendIndexesOutstanding, _networkStats->inputPackets, _networkStats->outputPackets,
+           _networkStats->inputErrors, _networkStats->outputErrors);
 }
 
 bool HyperVNetwork::wakePacketHandler(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength) {
-  return pktHeader->type == kVMBusPacketTypeCompletion;
+  //
+  // Only completions for synchronous requests need to be matched to a waiting thread.
+  // Send and RNDIS control completions are tagged and handled directly, avoiding the pending transaction list.
+  //
+  if (pktHeader->type != kVMBusPacketTypeCompletion) {
+    return false;
+  }
+  switch (pktHeader->transactionId & kHyperVNetworkTransIdTypeMask) {
+    case kHyperVNetworkSendTransIdBits:
+    case kHyperVNetworkControlTransIdBits:
+      return false;
+
+    default:
+      return true;
+  }
 }
 
 void HyperVNetwork::handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength) {
   //
   // Handle inbound packet.
   //
-  totalbytes += pktHeaderLength + pktDataLength + 8;
   switch (pktHeader->type) {
     case kVMBusPacketTypeDataInband:
       break;
@@ -36,8 +52,89 @@ void HyperVNetwork::handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderL
   }
 }
 
+void HyperVNetwork::handlePacketDrain() {
+  //
+  // Deliver all frames queued during this drain of the channel at once.
+  //
+  if (_ethInterface != nullptr) {
+    _ethInterface->flushInputQueue();
+  }
+  updateRxModeration();
+
+  //
+  // Receive completions share the ring buffer with transmits.
+  // Restart the output queue here as well in case it stalled without any sends outstanding.
+  //
+  restartOutputQueue();
+}
+
+void HyperVNetwork::configureRxBusyPoll() {
+  UInt32 budgetUS = 0;
+
+  //
+  // Busy-polling is only used if requested.
+  //
+  if (!PE_parse_boot_argn(kHyperVNetworkBusyPollBootArg, &budgetUS, sizeof (budgetUS)) || budgetUS == 0) {
+    return;
+  }
+  if (budgetUS > kHyperVNetworkBusyPollMaxUS) {
+    budgetUS = kHyperVNetworkBusyPollMaxUS;
+  }
+
+  if (_hvDevice->enableRxBusyPoll(budgetUS) != kIOReturnSuccess) {
+    HVSYSLOG("Failed to enable busy-polling");
+    return;
+  }
+  _rxBusyPollUS = budgetUS;
+  HVSYSLOG("Busy-polling enabled with budget of %u us", _rxBusyPollUS);
+}
+
+void HyperVNetwork::updateRxModeration() {
+  UInt64 currentTime;
+  UInt64 elapsedNs;
+  UInt64 packetRate;
+
+  //
+  // Busy-polling already avoids interrupts during high receive rates.
+  //
+  if (_rxBusyPollUS != 0) {
+    return;
+  }
+
+  //
+  // Sample the receive rate once per window.
+  //
+  clock_get_uptime(&currentTime);
+  if (_rxModerationStart == 0) {
+    _rxModerationStart = currentTime;
+    return;
+  }
+  absolutetime_to_nanoseconds(currentTime - _rxModerationStart, &elapsedNs);
+  if (elapsedNs < (kHyperVNetworkRxModerationWindowMS * kMillisecondScale)) {
+    return;
+  }
+  packetRate = ((UInt64)_rxModerationPackets * kSecondScale) / elapsedNs;
+  _rxModerationPackets = 0;
+  _rxModerationStart   = currentTime;
+
+  //
+  // Switch to polled mode during high receive rates, and back to interrupts once it drops.
+  // Thresholds are spaced apart to avoid switching back and forth.
+  //
+  if (!_hvDevice->isRxPolling()) {
+    if (_isNetworkEnabled && packetRate >= kHyperVNetworkRxModerationHighRate) {
+      HVDBGLOG("Receive rate of %llu packets/s, switching to polled mode", packetRate);
+      _hvDevice->enableRxPolling(kHyperVNetworkRxPollIntervalUS);
+    }
+  } else if (!_isNetworkEnabled || packetRate <= kHyperVNetworkRxModerationLowRate) {
+    HVDBGLOG("Receive rate of %llu packets/s, switching to interrupt mode", packetRate);
+    _hvDevice->disableRxPolling();
+  }
+}
+
 void HyperVNetwork::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 pktSize) {
-  UInt32 pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktPages->header.headerLength);
+  UInt32                   pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktPages->header.headerLength);
+  HyperVNetworkReceiveLoan *receiveLoan;
   
   HyperVNetworkMessage *netMsg = (HyperVNetworkMessage*) (((UInt8*)pktPages) + pktHeaderSize);
   
@@ -51,6 +148,12 @@ void HyperVNetwork::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32
   }
   HVDBGLOG("Received %u RNDIS ranges, range[0] count = %u, offset = 0x%X", pktPages->rangeCount, pktPages->ranges[0].count, pktPages->ranges[0].offset);
   
+  //
+  // Loan ranges to the network stack where possible.
+  // If no loan is available, all frames are copied and the completion is sent immediately.
+  //
+  receiveLoan = getReceiveLoan(pktPages->header.transactionId);
+
   //
   // Process each range which contains a packet.
   //
@@ -59,38 +162,57 @@ void HyperVNetwork::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32
     UInt32 dataLength = pktPages->ranges[i].count;
     
     HVDBGLOG("Got range of %u bytes at 0x%X", dataLength, pktPages->ranges[i].offset);
-    processRNDISPacket(data, dataLength);
+    if (((UInt64)pktPages->ranges[i].offset + dataLength) > _receiveBufferSize) {
+      HVSYSLOG("Range of %u bytes at 0x%X is outside of receive buffer", dataLength, pktPages->ranges[i].offset);
+      continue;
+    }
+    processRNDISPacket(data, dataLength, receiveLoan);
+  }
+
+  //
+  // Drop processing reference to the loan, the completion is sent once all loaned mbufs are freed.
+  //
+  if (receiveLoan != nullptr) {
+    releaseReceiveLoan(receiveLoan);
+  } else {
+    sendReceiveCompletion(pktPages->header.transactionId);
   }
-  
-  HyperVNetworkMessage netMsg2;
-  memset(&netMsg2, 0, sizeof (netMsg2));
-  netMsg2.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
-  netMsg2.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
-  
-  _hvDevice->writeCompletionPacketWithTransactionId(&netMsg2, sizeof (netMsg2), pktPages->header.transactionId, false);
- // postCycle++;
+}
+
+void HyperVNetwork::sendReceiveCompletion(UInt64 transactionId) {
+  HyperVNetworkMessage netMsg;
+
+  bzero(&netMsg, sizeof (netMsg));
+  netMsg.messageType                       = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
+  netMsg.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
+
+  _hvDevice->writeCompletionPacketWithTransactionId(&netMsg, sizeof (netMsg), transactionId, false);
 }
 
 void HyperVNetwork::handleCompletion(void *pktData, UInt32 pktLength) {
   VMBusPacketHeader *pktHeader = (VMBusPacketHeader*)pktData;
   UInt32 pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktHeader->headerLength);
   
-  HyperVNetworkMessage *netMsg;
-    netMsg = (HyperVNetworkMessage*)(((UInt8*)pktData) + pktHeaderSize);
-    if (netMsg->messageType == kHyperVNetworkMessageTypeV1SendRNDISPacketComplete) {
-    //  completions++;
-      //HVSYSLOG("Got index %X", pktHeader->transactionId & ~kHyperVNetworkSendTransIdBits);
-     // if (completions % 100000 == 0)
-     // HVSYSLOG("pkt completion status %X %X %u comple trans %u (free indexes %u)", netMsg->messageType, netMsg->v1.sendRNDISPacketComplete.status, completions, pktHeader->transactionId, getFreeSendIndexCount());
-      
-      if (netMsg->v1.sendRNDISPacketComplete.status != 1) {
-        HVSYSLOG("Got a nonsuccess %u", netMsg->v1.sendRNDISPacketComplete.status);
-      }
-      //HyperVSendPacketThing *pktThing = (HyperVSendPacketThing*)pktHeader->transactionId;
-      releaseSendIndex((UInt32)(pktHeader->transactionId & ~kHyperVNetworkSendTransIdBits));
-    } else {
-      HVSYSLOG("Unknown completion type 0x%X received", netMsg->messageType);
+  HyperVNetworkMessage *netMsg = (HyperVNetworkMessage*)(((UInt8*)pktData) + pktHeaderSize);
+
+  //
+  // RNDIS control requests are completed by their RNDIS response, nothing to do here.
+  //
+  if ((pktHeader->transactionId & kHyperVNetworkTransIdTypeMask) == kHyperVNetworkControlTransIdBits) {
+    return;
+  }
+
+  if ((pktHeader->transactionId & kHyperVNetworkTransIdTypeMask) == kHyperVNetworkSendTransIdBits
+      && netMsg->messageType == kHyperVNetworkMessageTypeV1SendRNDISPacketComplete) {
+    if (netMsg->v1.sendRNDISPacketComplete.status != kHyperVNetworkMessageStatusSuccess) {
+      HVDBGLOG("Send completion for section %u has status 0x%X",
+               (UInt32)(pktHeader->transactionId & ~kHyperVNetworkTransIdTypeMask), netMsg->v1.sendRNDISPacketComplete.status);
     }
+    releaseSendIndex((UInt32)(pktHeader->transactionId & ~kHyperVNetworkTransIdTypeMask));
+    restartOutputQueue();
+  } else {
+    HVSYSLOG("Unknown completion type 0x%X received (transaction 0x%llX)", netMsg->messageType, pktHeader->transactionId);
+  }
 }
 
 bool HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion) {
@@ -107,7 +229,8 @@ bool HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersi
   }
 
   if (netMsg.init.initComplete.status != kHyperVNetworkMessageStatusSuccess) {
-    HVSYSLOG("error returned from Hyper-V: 0x%X", netMsg.init.initComplete.status);
+    HVDBGLOG("Protocol 0x%X rejected by Hyper-V with status 0x%X", protocolVersion, netMsg.init.initComplete.status);
+    return false;
   }
 
   HVDBGLOG("Can use protocol 0x%X, max MDL length %u",
@@ -115,21 +238,88 @@ bool HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersi
   return true;
 }
 
+bool HyperVNetwork::sendNDISConfig(UInt32 mtu, UInt64 capabilities) {
+  HyperVNetworkMessage netMsg;
+
+  //
+  // NDIS configuration is only supported on protocol version 2 and newer.
+  //
+  bzero(&netMsg, sizeof (netMsg));
+  netMsg.messageType                     = kHyperVNetworkMessageTypeV2SendNDISConfig;
+  netMsg.v2.sendNDISConfig.mtu           = mtu + kHyperVNetworkEthernetHeaderSize;
+  netMsg.v2.sendNDISConfig.capabilities  = capabilities;
+
+  HVDBGLOG("Sending NDIS config with MTU of %u bytes and capabilities 0x%llX", mtu, capabilities);
+  if (_hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), false) != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send NDIS config");
+    return false;
+  }
+  return true;
+}
+
+void HyperVNetwork::readBufferSizes() {
+  UInt32 receiveBufferSizeMax;
+  UInt32 bufferSizeMB;
+
+  //
+  // Older versions of the protocol have a lower recieve buffer size limit.
+  //
+  if (_netVersion > kHyperVNetworkProtocolVersion2) {
+    _receiveBufferSize   = kHyperVNetworkReceiveBufferSize;
+    receiveBufferSizeMax = kHyperVNetworkReceiveBufferSizeMax;
+  } else {
+    _receiveBufferSize   = kHyperVNetworkReceiveBufferSizeLegacy;
+    receiveBufferSizeMax = kHyperVNetworkReceiveBufferSizeLegacy;
+  }
+  _sendBufferSize = kHyperVNetworkSendBufferSize;
+
+  //
+  // Allow sizes to be overridden, clamped to what Hyper-V supports.
+  //
+  if (PE_parse_boot_argn(kHyperVNetworkReceiveBufferSizeBootArg, &bufferSizeMB, sizeof (bufferSizeMB))) {
+    _receiveBufferSize = bufferSizeMB * 1024 * 1024;
+    if (bufferSizeMB > (receiveBufferSizeMax / (1024 * 1024))) {
+      _receiveBufferSize = receiveBufferSizeMax;
+    } else if (_receiveBufferSize < kHyperVNetworkReceiveBufferSizeMin) {
+      _receiveBufferSize = kHyperVNetworkReceiveBufferSizeMin;
+    }
+  }
+  if (PE_parse_boot_argn(kHyperVNetworkSendBufferSizeBootArg, &bufferSizeMB, sizeof (bufferSizeMB))) {
+    _sendBufferSize = bufferSizeMB * 1024 * 1024;
+    if (bufferSizeMB > (kHyperVNetworkSendBufferSizeMax / (1024 * 1024))) {
+      _sendBufferSize = kHyperVNetworkSendBufferSizeMax;
+    } else if (_sendBufferSize < kHyperVNetworkSendBufferSizeMin) {
+      _sendBufferSize = kHyperVNetworkSendBufferSizeMin;
+    }
+  }
+
+  _receiveLoanMaxBytes = _receiveBufferSize >> kHyperVNetworkReceiveLoanMaxShift;
+  HVDBGLOG("Using receive buffer of %u bytes and send buffer of %u bytes", _receiveBufferSize, _sendBufferSize);
+}
+
 IOReturn HyperVNetwork::initSendReceiveBuffers() {
   IOReturn             status;
   HyperVNetworkMessage netMsg;
-  
+  HyperVNetworkV1MessageReceiveBufferSection *receiveSections;
+  HyperVNetworkV1MessageReceiveBufferSection *receiveSection;
+
   //
-  // Older versions of the protocol have a lower recieve buffer size limit.
+  // Receive buffer completion may contain multiple sections.
+  // Sections run contiguously from the first section in the message, past the end of the message structure.
   //
-  _receiveBufferSize = (_netVersion > kHyperVNetworkProtocolVersion2) ?
-    kHyperVNetworkReceiveBufferSize : kHyperVNetworkReceiveBufferSizeLegacy;
-  _sendBufferSize    = kHyperVNetworkSendBufferSize;
+  union {
+    HyperVNetworkMessage netMsg;
+    UInt8                buffer[sizeof (HyperVNetworkMessage)
+                                + (sizeof (HyperVNetworkV1MessageReceiveBufferSection) * (kHyperVNetworkReceiveSectionMax - 1))];
+  } receiveResponse;
+
+  readBufferSizes();
 
   //
   // Allocate receive and send buffers and create GPADLs for them.
+  // These are only accessed by Hyper-V through the GPADLs, and do not need to be physically contiguous.
   //
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_receiveBuffer, _receiveBufferSize)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_receiveBuffer, _receiveBufferSize, false)) {
     HVSYSLOG("Failed to allocate receive buffer");
     freeSendReceiveBuffers();
     return kIOReturnNoResources;
@@ -139,7 +329,7 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
     freeSendReceiveBuffers();
     return kIOReturnIOError;
   }
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_sendBuffer, _sendBufferSize)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_sendBuffer, _sendBufferSize, false)) {
     HVSYSLOG("Failed to allocate send buffer");
     freeSendReceiveBuffers();
     return kIOReturnNoResources;
@@ -159,29 +349,47 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
   netMsg.v1.sendReceiveBuffer.gpadlHandle = _receiveGpadlHandle;
   netMsg.v1.sendReceiveBuffer.id          = kHyperVNetworkReceiveBufferID;
 
-  status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg));
+  bzero(&receiveResponse, sizeof (receiveResponse));
+  status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &receiveResponse, sizeof (receiveResponse));
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to send receive buffer configuration with status 0x%X", status);
     freeSendReceiveBuffers();
     return status;
   }
 
-  if (netMsg.v1.sendReceiveBufferComplete.status != kHyperVNetworkMessageStatusSuccess) {
-    HVSYSLOG("Failed to configure receive buffer with status 0x%X", netMsg.v1.sendReceiveBufferComplete.status);
+  if (receiveResponse.netMsg.v1.sendReceiveBufferComplete.status != kHyperVNetworkMessageStatusSuccess) {
+    HVSYSLOG("Failed to configure receive buffer with status 0x%X", receiveResponse.netMsg.v1.sendReceiveBufferComplete.status);
     freeSendReceiveBuffers();
     return kIOReturnIOError;
   }
 
   //
-  // Only allow 1 receive section.
-  // This is the same as what the Linux driver supports.
+  // Validate and save each receive section.
+  // Received ranges are always relative to the start of the receive buffer.
   //
-  if (netMsg.v1.sendReceiveBufferComplete.numSections != 1 || netMsg.v1.sendReceiveBufferComplete.sections[0].offset != 0) {
-    HVSYSLOG("Invalid receive buffer sections: %u", netMsg.v1.sendReceiveBufferComplete.numSections);
+  _receiveSectionCount = receiveResponse.netMsg.v1.sendReceiveBufferComplete.numSections;
+  if (_receiveSectionCount == 0 || _receiveSectionCount > kHyperVNetworkReceiveSectionMax) {
+    HVSYSLOG("Invalid receive buffer section count: %u", _receiveSectionCount);
+    _receiveSectionCount = 0;
     freeSendReceiveBuffers();
     return kIOReturnUnsupported;
   }
-  HVDBGLOG("Receive buffer configured at 0x%p", _receiveBuffer);
+  receiveSections = (HyperVNetworkV1MessageReceiveBufferSection *)
+    &receiveResponse.buffer[offsetof(HyperVNetworkMessage, v1.sendReceiveBufferComplete.sections)];
+  for (UInt32 i = 0; i < _receiveSectionCount; i++) {
+    receiveSection = &receiveSections[i];
+    if (receiveSection->offset >= receiveSection->endOffset || receiveSection->endOffset > _receiveBufferSize) {
+      HVSYSLOG("Invalid receive buffer section %u at 0x%X-0x%X", i, receiveSection->offset, receiveSection->endOffset);
+      _receiveSectionCount = 0;
+      freeSendReceiveBuffers();
+      return kIOReturnUnsupported;
+    }
+
+    _receiveSections[i] = *receiveSection;
+    HVDBGLOG("Receive section %u at 0x%X-0x%X with %u suballocations of %u bytes", i,
+             receiveSection->offset, receiveSection->endOffset, receiveSection->numSubAllocs, receiveSection->subAllocSize);
+  }
+  HVDBGLOG("Receive buffer configured at 0x%p with %u sections", _receiveBuffer.buffer, _receiveSectionCount);
 
   //
   // Configure Hyper-V Network with send buffer GPADL.
@@ -209,8 +417,9 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
   //
   _sendSectionSize        = netMsg.v1.sendSendBufferComplete.sectionSize;
   _sendSectionCount       = _sendBufferSize / _sendSectionSize;
-  _sendIndexMapSize       = ((_sendSectionCount * sizeof (UInt32)) / 32) + sizeof (UInt32);
+  _sendIndexMapSize       = ((_sendSectionCount + 31) / 32) * sizeof (UInt32);
   _sendIndexMap           = (UInt32 *)IOMalloc(_sendIndexMapSize);
+  _sendIndexMapHint       = 0;
   _sendIndexesOutstanding = 0;
   if (_sendIndexMap == nullptr) {
     HVSYSLOG("Failed to allocate send index map");
@@ -219,6 +428,31 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
   }
   bzero(_sendIndexMap, _sendIndexMapSize);
 
+  //
+  // Allocate tracking for packets sent directly from mbufs, and cursor to get their pages.
+  //
+  _sendPackets = (mbuf_t *)IOMalloc(sizeof (mbuf_t) * _sendSectionCount);
+  if (_sendPackets == nullptr) {
+    HVSYSLOG("Failed to allocate send packet tracking");
+    freeSendReceiveBuffers();
+    return kIOReturnNoResources;
+  }
+  bzero(_sendPackets, sizeof (mbuf_t) * _sendSectionCount);
+
+  _txMbufCursor = IOMbufNaturalMemoryCursor::withSpecification(PAGE_SIZE, kHyperVNetworkTransmitMaxSegments);
+  if (_txMbufCursor == nullptr) {
+    HVSYSLOG("Failed to allocate transmit mbuf cursor");
+    freeSendReceiveBuffers();
+    return kIOReturnNoResources;
+  }
+
+  //
+  // Mark bits past the last section as used so they are never allocated.
+  //
+  if ((_sendSectionCount % 32) != 0) {
+    _sendIndexMap[_sendSectionCount / 32] = ~((1U << (_sendSectionCount % 32)) - 1);
+  }
+
   HVDBGLOG("Send buffer configured at 0x%p-0x%p with section size of %u bytes and %u sections",
            _sendBuffer.buffer, _sendBuffer.buffer + (_sendSectionSize * (_sendSectionCount - 1)),
            _sendSectionSize, _sendSectionCount);
@@ -245,6 +479,20 @@ void HyperVNetwork::freeSendReceiveBuffers() {
   }
   _hvDevice->getHvController()->freeDmaBuffer(&_sendBuffer);
 
+  //
+  // Free any packets still held for GPA direct sends.
+  //
+  if (_sendPackets != nullptr) {
+    for (UInt32 i = 0; i < _sendSectionCount; i++) {
+      if (_sendPackets[i] != nullptr) {
+        freePacket(_sendPackets[i]);
+      }
+    }
+    IOFree(_sendPackets, sizeof (mbuf_t) * _sendSectionCount);
+    _sendPackets = nullptr;
+  }
+  OSSafeReleaseNULL(_txMbufCursor);
+
   //
   // Free send section tracking bitmap.
   //
@@ -255,36 +503,378 @@ void HyperVNetwork::freeSendReceiveBuffers() {
 }
 
 UInt32 HyperVNetwork::getNextSendIndex() {
-  for (UInt32 i = 0; i < _sendSectionCount; i++) {
-    if (!sync_test_and_set_bit(i, _sendIndexMap)) {
-      OSIncrementAtomic(&_sendIndexesOutstanding);
-      return i;
+  UInt32 wordCount = (UInt32)(_sendIndexMapSize / sizeof (UInt32));
+  UInt32 wordIndex = _sendIndexMapHint;
+  UInt32 word;
+  UInt32 sendIndex;
+
+  //
+  // Search each word for a free section, starting with the word a section was last allocated from.
+  // Fully used words are skipped without touching individual bits.
+  //
+  for (UInt32 i = 0; i < wordCount; i++) {
+    word = _sendIndexMap[wordIndex];
+    while (word != 0xFFFFFFFF) {
+      sendIndex = (wordIndex * 32) + __builtin_ctz(~word);
+      if (!sync_test_and_set_bit(sendIndex, _sendIndexMap)) {
+        _sendIndexMapHint = wordIndex;
+        OSIncrementAtomic(&_sendIndexesOutstanding);
+        return sendIndex;
+      }
+
+      //
+      // Lost race for this section, reload word and try again.
+      //
+      word = *((volatile UInt32 *)&_sendIndexMap[wordIndex]);
+    }
+
+    if (++wordIndex == wordCount) {
+      wordIndex = 0;
     }
   }
   return kHyperVNetworkRNDISSendSectionIndexInvalid;
 }
 
 UInt32 HyperVNetwork::getFreeSendIndexCount() {
+  UInt32 wordCount          = (UInt32)(_sendIndexMapSize / sizeof (UInt32));
   UInt32 freeSendIndexCount = 0;
-  for (UInt32 i = 0; i < _sendSectionCount; i++) {
-    if ((_sendIndexMap[i / 32] & (i % 32)) == 0) {
-      freeSendIndexCount++;
-    }
+
+  //
+  // Bits past the last section are always set and are not counted.
+  //
+  for (UInt32 i = 0; i < wordCount; i++) {
+    freeSendIndexCount += 32 - __builtin_popcount(_sendIndexMap[i]);
   }
   return freeSendIndexCount;
 }
 
 void HyperVNetwork::releaseSendIndex(UInt32 sendIndex) {
-  sync_change_bit(sendIndex, _sendIndexMap);
+  if (sendIndex >= _sendSectionCount) {
+    HVSYSLOG("Attempted to release invalid send section %u", sendIndex);
+    return;
+  }
+
+  //
+  // Free packet if it was sent directly from the mbuf.
+  //
+  if (_sendPackets != nullptr && _sendPackets[sendIndex] != nullptr) {
+    freePacket(_sendPackets[sendIndex]);
+    _sendPackets[sendIndex] = nullptr;
+  }
+
+  sync_clear_bit(sendIndex, _sendIndexMap);
   OSDecrementAtomic(&_sendIndexesOutstanding);
 }
 
+bool HyperVNetwork::isTxRingAvailable() {
+  UInt32 readBytes;
+  UInt32 writeBytes;
+
+  _hvDevice->getAvailableTxSpace(&readBytes, &writeBytes);
+  return writeBytes > kHyperVNetworkTransmitRingMinFreeSpace;
+}
+
+bool HyperVNetwork::addTransmitPageBuffers(VMBusSinglePageBuffer *pageBuffers, UInt32 *pageBufferCount, UInt64 physAddr, UInt32 length) {
+  UInt32 pageLength;
+
+  //
+  // Split physically contiguous range at page boundaries, each page buffer must be within a single page.
+  //
+  while (length > 0) {
+    if (*pageBufferCount >= kVMBusMaxPageBufferCount) {
+      return false;
+    }
+
+    pageLength = PAGE_SIZE - (UInt32)(physAddr & PAGE_MASK);
+    if (pageLength > length) {
+      pageLength = length;
+    }
+
+    pageBuffers[*pageBufferCount].pfn    = physAddr >> PAGE_SHIFT;
+    pageBuffers[*pageBufferCount].offset = (UInt32)(physAddr & PAGE_MASK);
+    pageBuffers[*pageBufferCount].length = pageLength;
+    (*pageBufferCount)++;
+
+    physAddr += pageLength;
+    length   -= pageLength;
+  }
+  return true;
+}
+
+void HyperVNetwork::restartOutputQueue() {
+  //
+  // Restart the output queue if it was stalled due to lack of send sections or ring space.
+  // Completions are handled on the same work loop as transmits, no locking is needed.
+  //
+  if (_isTxStalled && _outputQueue != nullptr) {
+    if (flushTransmitAggregate() != kIOReturnSuccess) {
+      return;
+    }
+    _isTxStalled = false;
+    _outputQueue->service(IOBasicOutputQueue::kServiceAsync);
+  }
+}
+
+bool HyperVNetwork::allocateReceiveLoans() {
+  size_t receiveLoansSize = sizeof (*_receiveLoans) * kHyperVNetworkReceiveLoanCount;
+
+  _receiveLoanLock = IOSimpleLockAlloc();
+  if (_receiveLoanLock == nullptr) {
+    HVSYSLOG("Failed to allocate receive loan lock");
+    return false;
+  }
+
+  _receiveLoans = (HyperVNetworkReceiveLoan *)IOMalloc(receiveLoansSize);
+  if (_receiveLoans == nullptr) {
+    HVSYSLOG("Failed to allocate receive loans");
+    return false;
+  }
+  bzero(_receiveLoans, receiveLoansSize);
+
+  //
+  // Build free list of loans.
+  //
+  _receiveLoanFreeList = nullptr;
+  for (UInt32 i = 0; i < kHyperVNetworkReceiveLoanCount; i++) {
+    _receiveLoans[i].network = this;
+    _receiveLoans[i].next    = _receiveLoanFreeList;
+    _receiveLoanFreeList     = &_receiveLoans[i];
+  }
+  _receiveLoanCompleteList = nullptr;
+  _isReceiveLoanCancelled  = false;
+  _receiveLoanedBytes      = 0;
+
+  //
+  // Loans may be returned from any context, completions are sent to Hyper-V from the work loop.
+  //
+  _receiveLoanEventSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                         OSMemberFunctionCast(IOInterruptEventSource::Action, this, &HyperVNetwork::handleReceiveLoanCompletions));
+  if (_receiveLoanEventSource == nullptr) {
+    HVSYSLOG("Failed to create receive loan event source");
+    return false;
+  }
+  getWorkLoop()->addEventSource(_receiveLoanEventSource);
+  _receiveLoanEventSource->enable();
+
+  HVDBGLOG("Allocated %u receive loans, copy break is %u bytes", kHyperVNetworkReceiveLoanCount, kHyperVNetworkReceiveCopyBreak);
+  return true;
+}
+
+void HyperVNetwork::freeReceiveLoans() {
+  //
+  // Only called once all loans have been returned, as each outstanding loan holds a reference to us.
+  //
+  if (_receiveLoanEventSource != nullptr) {
+    _receiveLoanEventSource->disable();
+    getWorkLoop()->removeEventSource(_receiveLoanEventSource);
+    OSSafeReleaseNULL(_receiveLoanEventSource);
+  }
+
+  if (_receiveLoans != nullptr) {
+    IOFree(_receiveLoans, sizeof (*_receiveLoans) * kHyperVNetworkReceiveLoanCount);
+    _receiveLoans = nullptr;
+  }
+  _receiveLoanFreeList = nullptr;
+
+  if (_receiveLoanLock != nullptr) {
+    IOSimpleLockFree(_receiveLoanLock);
+    _receiveLoanLock = nullptr;
+  }
+}
+
+HyperVNetworkReceiveLoan* HyperVNetwork::getReceiveLoan(UInt64 transactionId) {
+  HyperVNetworkReceiveLoan *receiveLoan;
+
+  if (_receiveLoanLock == nullptr) {
+    return nullptr;
+  }
+
+  IOSimpleLockLock(_receiveLoanLock);
+  receiveLoan = _isReceiveLoanCancelled ? nullptr : _receiveLoanFreeList;
+  if (receiveLoan != nullptr) {
+    _receiveLoanFreeList = receiveLoan->next;
+  }
+  IOSimpleLockUnlock(_receiveLoanLock);
+
+  if (receiveLoan == nullptr) {
+    return nullptr;
+  }
+
+  //
+  // Caller holds the initial reference until processing of the transfer pages packet is complete.
+  // Driver object must stay around until the loan is returned.
+  //
+  receiveLoan->transactionId = transactionId;
+  receiveLoan->refCount      = 1;
+  receiveLoan->next          = nullptr;
+  retain();
+  return receiveLoan;
+}
+
+void HyperVNetwork::releaseReceiveLoan(HyperVNetworkReceiveLoan *receiveLoan) {
+  if (OSDecrementAtomic(&receiveLoan->refCount) != 1) {
+    return;
+  }
+
+  //
+  // Last reference is gone. This may be called from the mbuf free path in any context,
+  // so only queue the loan here and return the receive buffer ranges to Hyper-V from the work loop.
+  //
+  // Once loans are cancelled the channel is being closed, no completion is sent.
+  //
+  IOSimpleLockLock(_receiveLoanLock);
+  if (_isReceiveLoanCancelled) {
+    IOSimpleLockUnlock(_receiveLoanLock);
+    recycleReceiveLoan(receiveLoan);
+    return;
+  }
+
+  receiveLoan->next        = _receiveLoanCompleteList;
+  _receiveLoanCompleteList = receiveLoan;
+  if (receiveLoan->next == nullptr) {
+    _receiveLoanEventSource->interruptOccurred(nullptr, this, 0);
+  }
+  IOSimpleLockUnlock(_receiveLoanLock);
+}
+
+void HyperVNetwork::recycleReceiveLoan(HyperVNetworkReceiveLoan *receiveLoan) {
+  IOSimpleLockLock(_receiveLoanLock);
+  receiveLoan->next    = _receiveLoanFreeList;
+  _receiveLoanFreeList = receiveLoan;
+  IOSimpleLockUnlock(_receiveLoanLock);
+  release();
+}
+
+void HyperVNetwork::handleReceiveLoanCompletions(IOInterruptEventSource *sender, int count) {
+  HyperVNetworkReceiveLoan *receiveLoan;
+  HyperVNetworkReceiveLoan *nextLoan;
+
+  IOSimpleLockLock(_receiveLoanLock);
+  receiveLoan              = _receiveLoanCompleteList;
+  _receiveLoanCompleteList = nullptr;
+  IOSimpleLockUnlock(_receiveLoanLock);
+
+  while (receiveLoan != nullptr) {
+    nextLoan = receiveLoan->next;
+    sendReceiveCompletion(receiveLoan->transactionId);
+    recycleReceiveLoan(receiveLoan);
+    receiveLoan = nextLoan;
+  }
+}
+
+void HyperVNetwork::cancelReceiveLoans() {
+  if (_receiveLoanEventSource == nullptr) {
+    return;
+  }
+
+  //
+  // Send completions already queued while the channel is still open, then stop sending completions.
+  // Loans still held by the network stack are recycled when their mbufs are freed.
+  //
+  getCommandGate()->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVNetwork::cancelReceiveLoansGated));
+  _receiveLoanEventSource->disable();
+  getWorkLoop()->removeEventSource(_receiveLoanEventSource);
+  OSSafeReleaseNULL(_receiveLoanEventSource);
+}
+
+void HyperVNetwork::cancelReceiveLoansGated() {
+  handleReceiveLoanCompletions(_receiveLoanEventSource, 0);
+
+  IOSimpleLockLock(_receiveLoanLock);
+  _isReceiveLoanCancelled = true;
+  IOSimpleLockUnlock(_receiveLoanLock);
+
+  //
+  // A loan may have been queued between the flush and cancellation.
+  //
+  handleReceiveLoanCompletions(_receiveLoanEventSource, 0);
+}
+
+mbuf_t HyperVNetwork::loanReceivePacket(UInt8 *pktData, UInt32 pktLength, HyperVNetworkReceiveLoan *receiveLoan) {
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
+  mbuf_t newPacket = nullptr;
+
+  //
+  // Limit the amount of the receive buffer held by the stack, otherwise Hyper-V will run out of space.
+  //
+  if ((OSAddAtomic(pktLength, &_receiveLoanedBytes) + (SInt32)pktLength) > _receiveLoanMaxBytes) {
+    OSAddAtomic(-(SInt32)pktLength, &_receiveLoanedBytes);
+    return nullptr;
+  }
+
+  //
+  // Attach receive buffer range as external storage.
+  // The loan reference is dropped in freeReceiveLoanPacket() when the stack frees the mbuf.
+  //
+  OSIncrementAtomic(&receiveLoan->refCount);
+  if (mbuf_attachcluster(MBUF_DONTWAIT, MBUF_TYPE_DATA, &newPacket, (caddr_t)pktData,
+                         freeReceiveLoanPacket, pktLength, (caddr_t)receiveLoan) != 0) {
+    OSDecrementAtomic(&receiveLoan->refCount);
+    OSAddAtomic(-(SInt32)pktLength, &_receiveLoanedBytes);
+    return nullptr;
+  }
+
+  mbuf_setdata(newPacket, pktData, pktLength);
+  mbuf_pkthdr_setlen(newPacket, pktLength);
+  return newPacket;
+#else
+  //
+  // External mbuf storage is not available, always copy.
+  //
+  return nullptr;
+#endif
+}
+
+void HyperVNetwork::freeReceiveLoanPacket(caddr_t buffer, u_int size, caddr_t arg) {
+  HyperVNetworkReceiveLoan *receiveLoan = (HyperVNetworkReceiveLoan *)arg;
+  HyperVNetwork            *network     = receiveLoan->network;
+
+  OSAddAtomic(-(SInt32)size, &network->_receiveLoanedBytes);
+  network->releaseReceiveLoan(receiveLoan);
+}
+
 bool HyperVNetwork::connectNetwork() {
   IOReturn status;
   
-  // Negotiate max protocol version with Hyper-V.
-  negotiateProtocol(kHyperVNetworkProtocolVersion1);
-  _netVersion = kHyperVNetworkProtocolVersion1;
+  //
+  // Negotiate max protocol version with Hyper-V, trying each version from newest to oldest.
+  //
+  static const HyperVNetworkProtocolVersion protocolVersions[] = {
+    kHyperVNetworkProtocolVersion61,
+    kHyperVNetworkProtocolVersion6,
+    kHyperVNetworkProtocolVersion5,
+    kHyperVNetworkProtocolVersion4,
+    kHyperVNetworkProtocolVersion2,
+    kHyperVNetworkProtocolVersion1
+  };
+  
+  bool protocolNegotiated = false;
+  for (UInt32 i = 0; i < arrsize(protocolVersions); i++) {
+    if (negotiateProtocol(protocolVersions[i])) {
+      _netVersion        = protocolVersions[i];
+      protocolNegotiated = true;
+      break;
+    }
+  }
+  if (!protocolNegotiated) {
+    HVSYSLOG("Failed to negotiate protocol version");
+    return false;
+  }
+  HVDBGLOG("Using protocol version 0x%X", _netVersion);
+
+  //
+  // Configure jumbo frame MTU and 802.1Q tagging on newer protocols.
+  // Older protocols are limited to the standard MTU and no VLAN offload.
+  //
+  _maxMtu          = kHyperVNetworkMTUDefault;
+  _isVlanSupported = false;
+  if (_netVersion >= kHyperVNetworkProtocolVersion2) {
+    if (sendNDISConfig(kHyperVNetworkMTUMaximum, kHyperVNetworkV2CapabilityIEEE8021Q)) {
+      _maxMtu          = kHyperVNetworkMTUMaximum;
+      _isVlanSupported = true;
+    }
+  }
+  _currentMtu = kHyperVNetworkMTUDefault;
   
   // Send NDIS version.
   UInt32 ndisVersion = _netVersion > kHyperVNetworkProtocolVersion4 ?
@@ -306,16 +896,23 @@ bool HyperVNetwork::connectNetwork() {
     HVSYSLOG("Failed to initialize send/receive buffers with status 0x%X", status);
     return false;
   }
+
+  //
+  // Receive loans are optional, frames are copied if they cannot be allocated.
+  //
+  if (!allocateReceiveLoans()) {
+    HVSYSLOG("Failed to allocate receive loans, zero-copy receive is disabled");
+    freeReceiveLoans();
+  }
   
   initializeRNDIS();
   
   createMediumDictionary();
   readMACAddress();
+  readMaximumFrameSize();
+  readMulticastListSize();
   updateLinkState(NULL);
   
-  //UInt32 filter = 0x9;
-  //setRNDISOID(kHyperVNetworkRNDISOIDGeneralCurrentPacketFilter, &filter, sizeof (filter));
-  
   return true;
 }
 
@@ -358,6 +955,316 @@ bool HyperVNetwork::readMACAddress() {
   return true;
 }
 
+void HyperVNetwork::readMaximumFrameSize() {
+  UInt32 frameSize     = 0;
+  UInt32 frameSizeSize = sizeof (frameSize);
+
+  //
+  // Limit MTU to what the host reports, if anything.
+  //
+  if (getRNDISOID(kHyperVNetworkRNDISOIDGeneralMaximumFrameSize, &frameSize, &frameSizeSize) != kIOReturnSuccess) {
+    HVSYSLOG("Failed to get maximum frame size");
+    return;
+  }
+
+  HVDBGLOG("Maximum frame size is %u bytes", frameSize);
+  if (frameSize >= kHyperVNetworkMTUDefault && frameSize < _maxMtu) {
+    _maxMtu = frameSize;
+  }
+  HVDBGLOG("Maximum MTU is %u bytes", _maxMtu);
+}
+
+void HyperVNetwork::readMulticastListSize() {
+  UInt32 listSize     = 0;
+  UInt32 listSizeSize = sizeof (listSize);
+
+  //
+  // Multicast list filtering is not used if the host does not support it.
+  //
+  _multicastListMax = 0;
+  if (getRNDISOID(kHyperVNetworkRNDISOIDEthernetMaximumListSize, &listSize, &listSizeSize) != kIOReturnSuccess) {
+    HVSYSLOG("Failed to get maximum multicast list size");
+    return;
+  }
+
+  _multicastListMax = listSize < kHyperVNetworkMulticastListMax ? listSize : kHyperVNetworkMulticastListMax;
+  HVDBGLOG("Maximum multicast list size is %u addresses (using %u)", listSize, _multicastListMax);
+}
+
+void HyperVNetwork::updatePacketFilter() {
+  UInt32 filter = 0;
+
+  //
+  // Only one update can be in progress at a time, changes made during an update are applied once it completes.
+  // This is always called on the work loop.
+  //
+  if (_isPacketFilterUpdating) {
+    _isPacketFilterPending = true;
+    return;
+  }
+  _isPacketFilterUpdating = true;
+  _isPacketFilterPending  = false;
+
+  //
+  // Determine packet filter from current state.
+  // No packets are received while the interface is disabled.
+  //
+  if (_isNetworkEnabled) {
+    filter = kHyperVNetworkRNDISPacketFilterDirected | kHyperVNetworkRNDISPacketFilterBroadcast;
+    if (_isPromiscuous) {
+      filter |= kHyperVNetworkRNDISPacketFilterPromiscuous;
+    }
+
+    if (_isMulticastEnabled) {
+      if (_multicastListCount > _multicastListMax) {
+        filter |= kHyperVNetworkRNDISPacketFilterAllMulticast;
+      } else if (_multicastListCount > 0) {
+        filter |= kHyperVNetworkRNDISPacketFilterMulticast;
+      }
+    }
+  }
+
+  //
+  // Program multicast list first, the packet filter is set once that completes.
+  //
+  if (filter & kHyperVNetworkRNDISPacketFilterMulticast) {
+    HVDBGLOG("Setting multicast list of %u addresses", _multicastListCount);
+    if (setRNDISOIDAsync(kHyperVNetworkRNDISOIDEthernetMulticastList, _multicastList, sizeof (_multicastList[0]) * _multicastListCount,
+                         &HyperVNetwork::handleMulticastListSet, (void *)(uintptr_t)filter) == kIOReturnSuccess) {
+      return;
+    }
+    HVSYSLOG("Failed to send multicast list of %u addresses, receiving all multicast", _multicastListCount);
+    filter = (filter & ~kHyperVNetworkRNDISPacketFilterMulticast) | kHyperVNetworkRNDISPacketFilterAllMulticast;
+  }
+
+  handleMulticastListSet(kIOReturnSuccess, nullptr, (void *)(uintptr_t)filter);
+}
+
+void HyperVNetwork::handleMulticastListSet(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context) {
+  UInt32 filter = (UInt32)(uintptr_t)context;
+
+  //
+  // Fall back to all multicast if the host rejected the list.
+  //
+  if (status != kIOReturnSuccess
+      || (rndisResponse != nullptr && rndisResponse->setOIDComplete.status != kHyperVNetworkRNDISStatusSuccess)) {
+    HVSYSLOG("Failed to set multicast list, receiving all multicast");
+    filter = (filter & ~kHyperVNetworkRNDISPacketFilterMulticast) | kHyperVNetworkRNDISPacketFilterAllMulticast;
+  }
+
+  HVDBGLOG("Setting packet filter to 0x%X", filter);
+  if (setRNDISOIDAsync(kHyperVNetworkRNDISOIDGeneralCurrentPacketFilter, &filter, sizeof (filter),
+                       &HyperVNetwork::handlePacketFilterSet, (void *)(uintptr_t)filter) != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send packet filter of 0x%X", filter);
+    handlePacketFilterSet(kIOReturnIOError, nullptr, (void *)(uintptr_t)filter);
+  }
+}
+
+void HyperVNetwork::handlePacketFilterSet(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context) {
+  UInt32 filter = (UInt32)(uintptr_t)context;
+
+  if (status == kIOReturnSuccess && rndisResponse->setOIDComplete.status == kHyperVNetworkRNDISStatusSuccess) {
+    HVDBGLOG("Packet filter set to 0x%X", filter);
+  } else if (status == kIOReturnSuccess) {
+    HVSYSLOG("Failed to set packet filter to 0x%X with status 0x%X", filter, rndisResponse->setOIDComplete.status);
+  } else {
+    HVSYSLOG("Failed to set packet filter to 0x%X", filter);
+  }
+
+  //
+  // Apply any changes made while this update was in progress.
+  //
+  _isPacketFilterUpdating = false;
+  if (_isPacketFilterPending) {
+    updatePacketFilter();
+  }
+}
+
+bool HyperVNetwork::allocateStatistics() {
+  //
+  // Allocate cache line aligned statistics for each CPU.
+  //
+  _cpuStatsCount = real_ncpus;
+  _cpuStats      = (HyperVNetworkCPUStats *)IOMallocAligned(sizeof (*_cpuStats) * _cpuStatsCount, kHyperVNetworkStatsCacheLineSize);
+  if (_cpuStats == nullptr) {
+    _cpuStatsCount = 0;
+    return false;
+  }
+  bzero(_cpuStats, sizeof (*_cpuStats) * _cpuStatsCount);
+
+  HVDBGLOG("Allocated statistics for %u CPUs", _cpuStatsCount);
+  return true;
+}
+
+void HyperVNetwork::freeStatistics() {
+  if (_cpuStats != nullptr) {
+    IOFreeAligned(_cpuStats, sizeof (*_cpuStats) * _cpuStatsCount);
+    _cpuStats      = nullptr;
+    _cpuStatsCount = 0;
+  }
+}
+
+void HyperVNetwork::collectStatistics() {
+  HyperVNetworkCPUStats totals = { };
+
+  if (_cpuStats == nullptr || _networkStats == nullptr || _ethernetStats == nullptr) {
+    return;
+  }
+
+  //
+  // Sum counters from all CPUs into the interface statistics.
+  //
+  for (UInt32 i = 0; i < _cpuStatsCount; i++) {
+    totals.rxPackets   += _cpuStats[i].rxPackets;
+    totals.rxBytes     += _cpuStats[i].rxBytes;
+    totals.rxErrors    += _cpuStats[i].rxErrors;
+    totals.rxNoBuffers += _cpuStats[i].rxNoBuffers;
+    totals.txPackets   += _cpuStats[i].txPackets;
+    totals.txBytes     += _cpuStats[i].txBytes;
+    totals.txErrors    += _cpuStats[i].txErrors;
+    totals.txStalls    += _cpuStats[i].txStalls;
+  }
+
+  _networkStats->inputPackets                     = (UInt32)totals.rxPackets;
+  _networkStats->inputErrors                      = (UInt32)(totals.rxErrors + totals.rxNoBuffers);
+  _networkStats->outputPackets                    = (UInt32)totals.txPackets;
+  _networkStats->outputErrors                     = (UInt32)totals.txErrors;
+  _ethernetStats->dot3RxExtraEntry.resourceErrors = (UInt32)totals.rxNoBuffers;
+  _ethernetStats->dot3TxExtraEntry.resourceErrors = (UInt32)totals.txStalls;
+}
+
+IOReturn HyperVNetwork::handleStatisticsAccess(void *target, void *param, IONetworkData *data, UInt32 accessType,
+                                               void *buffer, UInt32 *bufferSize, UInt32 offset) {
+  HyperVNetwork *network = (HyperVNetwork *)target;
+
+  //
+  // Statistics are about to be read, refresh them.
+  // Host statistics are requested on the work loop and published once they arrive.
+  //
+  network->collectStatistics();
+  if (network->getCommandGate() != nullptr) {
+    network->getCommandGate()->runAction(OSMemberFunctionCast(IOCommandGate::Action, network, &HyperVNetwork::updateStatisticsGated));
+  }
+  return kIOReturnSuccess;
+}
+
+void HyperVNetwork::updateStatisticsGated() {
+  UInt64 currentTime;
+  UInt64 intervalTime;
+
+  //
+  // Limit how often the host is queried.
+  //
+  clock_get_uptime(&currentTime);
+  nanoseconds_to_absolutetime(kHyperVNetworkHostStatsIntervalMS * kMillisecondScale, &intervalTime);
+  if (_hostStatsPending > 0 || (_hostStatsLastUpdate != 0 && (currentTime - _hostStatsLastUpdate) < intervalTime)) {
+    return;
+  }
+  _hostStatsLastUpdate = currentTime;
+
+  updateHostStatistics();
+}
+
+void HyperVNetwork::updateHostStatistics() {
+  static const HyperVNetworkRNDISOID hostStatOids[kHyperVNetworkHostStatCount] = {
+    kHyperVNetworkRNDISOIDGeneralTransmitOk,
+    kHyperVNetworkRNDISOIDGeneralReceiveOk,
+    kHyperVNetworkRNDISOIDGeneralTransmitError,
+    kHyperVNetworkRNDISOIDGeneralReceiveError,
+    kHyperVNetworkRNDISOIDGeneralReceiveNoBuffer
+  };
+
+  //
+  // Request all host statistics, they are published once the last one completes.
+  //
+  for (UInt32 i = 0; i < arrsize(hostStatOids); i++) {
+    if (getRNDISOIDAsync(hostStatOids[i], &HyperVNetwork::handleHostStatistic, (void *)(uintptr_t)i) == kIOReturnSuccess) {
+      _hostStatsPending++;
+    }
+  }
+}
+
+void HyperVNetwork::handleHostStatistic(IOReturn status, HyperVNetworkRNDISMessage *rndisResponse, void *context) {
+  UInt32 stat = (UInt32)(uintptr_t)context;
+  UInt32 infoBufferOffset;
+  UInt32 infoBufferLength;
+  UInt8  *infoBuffer;
+
+  if (status == kIOReturnSuccess && rndisResponse->getOIDComplete.status == kHyperVNetworkRNDISStatusSuccess) {
+    infoBufferOffset = rndisResponse->getOIDComplete.infoBufferOffset;
+    infoBufferLength = rndisResponse->getOIDComplete.infoBufferLength;
+
+    //
+    // Host may return either a 32-bit or 64-bit counter.
+    //
+    if (((UInt64)sizeof (rndisResponse->header) + infoBufferOffset + infoBufferLength) <= PAGE_SIZE) {
+      infoBuffer = (UInt8 *)(&rndisResponse->getOIDComplete) + infoBufferOffset;
+      if (infoBufferLength == sizeof (UInt64)) {
+        _hostStats[stat] = *((UInt64 *)infoBuffer);
+      } else if (infoBufferLength == sizeof (UInt32)) {
+        _hostStats[stat] = *((UInt32 *)infoBuffer);
+      }
+    }
+  } else {
+    HVDBGLOG("Failed to get host statistic %u", stat);
+  }
+
+  if (_hostStatsPending > 0) {
+    _hostStatsPending--;
+  }
+  if (_hostStatsPending == 0) {
+    publishHostStatistics();
+  }
+}
+
+void HyperVNetwork::publishHostStatistics() {
+  static const char *hostStatNames[kHyperVNetworkHostStatCount] = {
+    "HostTransmitOk",
+    "HostReceiveOk",
+    "HostTransmitError",
+    "HostReceiveError",
+    "HostReceiveNoBuffer"
+  };
+  OSDictionary *statsDict;
+  OSNumber     *statNumber;
+  UInt64       rxBytes = 0;
+  UInt64       txBytes = 0;
+
+  statsDict = OSDictionary::withCapacity(kHyperVNetworkHostStatCount + 2);
+  if (statsDict == nullptr) {
+    return;
+  }
+
+  for (UInt32 i = 0; i < arrsize(hostStatNames); i++) {
+    statNumber = OSNumber::withNumber(_hostStats[i], 64);
+    if (statNumber != nullptr) {
+      statsDict->setObject(hostStatNames[i], statNumber);
+      statNumber->release();
+    }
+  }
+
+  //
+  // Byte counts are not part of the interface statistics, publish them here.
+  //
+  for (UInt32 i = 0; i < _cpuStatsCount; i++) {
+    rxBytes += _cpuStats[i].rxBytes;
+    txBytes += _cpuStats[i].txBytes;
+  }
+  statNumber = OSNumber::withNumber(rxBytes, 64);
+  if (statNumber != nullptr) {
+    statsDict->setObject("ReceiveBytes", statNumber);
+    statNumber->release();
+  }
+  statNumber = OSNumber::withNumber(txBytes, 64);
+  if (statNumber != nullptr) {
+    statsDict->setObject("TransmitBytes", statNumber);
+    statNumber->release();
+  }
+
+  setProperty(kHyperVNetworkStatisticsKey, statsDict);
+  statsDict->release();
+}
+
 void HyperVNetwork::updateLinkState(HyperVNetworkRNDISMessageIndicateStatus *indicateStatus) {
   //
   // Pull initial link state from OID.
@@ -7,62 +7,22 @@
 
 #include "HyperVNetwork.hpp"
 
-bool HyperVNetwork::processRNDISPacket(UInt8 *data, UInt32 dataLength) {
- // preCycle++;
+bool HyperVNetwork::processRNDISPacket(UInt8 *data, UInt32 dataLength, HyperVNetworkReceiveLoan *receiveLoan) {
   HyperVNetworkRNDISMessage *rndisPkt = (HyperVNetworkRNDISMessage*)data;
   
   HVDBGLOG("New RNDIS packet of type 0x%X and %u bytes", rndisPkt->header.type, rndisPkt->header.length);
   
-  HyperVNetworkRNDISRequest *reqCurr = rndisRequests;
-  HyperVNetworkRNDISRequest *reqPrev = NULL;
-  
   switch (rndisPkt->header.type) {
     case kHyperVNetworkRNDISMessageTypeInitComplete:
     case kHyperVNetworkRNDISMessageTypeGetOIDComplete:
     case kHyperVNetworkRNDISMessageTypeSetOIDComplete:
     case kHyperVNetworkRNDISMessageTypeResetComplete:
-
-      
-      while (reqCurr != NULL) {
-        HVDBGLOG("checking %u", reqCurr->message.initComplete.requestId);
-        if (reqCurr->message.initComplete.requestId == rndisPkt->initComplete.requestId) {
-          //
-          // Copy response data.
-          //
-          memcpy(&reqCurr->message, rndisPkt, dataLength);
-          
-          //
-          // Remove from linked list.
-          //
-          IOLockLock(rndisLock);
-          if (reqPrev == NULL) {
-            rndisRequests = reqCurr->next;
-          } else {
-            reqPrev->next = reqCurr->next;
-          }
-          IOLockUnlock(rndisLock);
-          
-          //
-          // Wakeup sleeping thread.
-          //
-          IOLockLock(reqCurr->lock);
-          reqCurr->isSleeping = false;
-          IOLockUnlock(reqCurr->lock);
-          IOLockWakeup(reqCurr->lock, &reqCurr->isSleeping, true);
-        //  midCycle++;
-          return true;
-        }
-        
-        reqPrev = reqCurr;
-        reqCurr = reqCurr->next;
-      }
+      completeRNDISRequest(rndisPkt, dataLength);
       break;
       
     case kHyperVNetworkRNDISMessageTypePacket:
       if (_isNetworkEnabled) {
-        
-        processIncoming(data, dataLength);
-        
+        processIncoming(data, dataLength, receiveLoan);
       }
       break;
       
@@ -77,129 +37,436 @@ bool HyperVNetwork::processRNDISPacket(UInt8 *data, UInt32 dataLength) {
   return true;
 }
 
-void HyperVNetwork::processIncoming(UInt8 *data, UInt32 dataLength) {
+void HyperVNetwork::processIncoming(UInt8 *data, UInt32 dataLength, HyperVNetworkReceiveLoan *receiveLoan) {
   HyperVNetworkRNDISMessage *rndisPkt = (HyperVNetworkRNDISMessage*)data;
-  UInt8 *pktData = data + 8 + rndisPkt->dataPacket.dataOffset;
-  
-  preCycle++;
-  mbuf_t newPacket = allocatePacket(rndisPkt->dataPacket.dataLength);
+  UInt8                     *pktData;
+  UInt32                    pktLength;
+  mbuf_t                    newPacket = nullptr;
+  HyperVNetworkCPUStats     *cpuStats;
+  UInt32                    vlanTag;
+
+  //
+  // Ensure packet data lies within the receive range.
+  //
+  pktLength = rndisPkt->dataPacket.dataLength;
+  if (pktLength == 0
+      || ((UInt64)sizeof (rndisPkt->header) + rndisPkt->dataPacket.dataOffset + pktLength) > dataLength) {
+    HVDBGLOG("Invalid RNDIS data packet of %u bytes at offset 0x%X, range is %u bytes",
+             pktLength, rndisPkt->dataPacket.dataOffset, dataLength);
+    OSIncrementAtomic64((SInt64 *)&getCPUStats()->rxErrors);
+    return;
+  }
+  pktData = data + sizeof (rndisPkt->header) + rndisPkt->dataPacket.dataOffset;
+
+  //
+  // Loan larger frames directly from the receive buffer.
+  //
+  if (receiveLoan != nullptr && pktLength >= kHyperVNetworkReceiveCopyBreak) {
+    newPacket = loanReceivePacket(pktData, pktLength, receiveLoan);
+  }
+
+  //
+  // Copy smaller frames, or frames that could not be loaned, into a new mbuf.
+  // Drop the frame if no mbufs are available.
+  //
   if (newPacket == nullptr) {
-    panic("zero packet mbuf");
+    newPacket = allocatePacket(pktLength);
+    if (newPacket == nullptr) {
+      HVDBGLOG("Failed to allocate mbuf for packet of %u bytes, dropping", pktLength);
+      OSIncrementAtomic64((SInt64 *)&getCPUStats()->rxNoBuffers);
+      return;
+    }
+    mbuf_copyback(newPacket, 0, pktLength, pktData, MBUF_DONTWAIT);
   }
-  midCycle++;
-  //memcpy(mbuf_data(newPacket), pktData, rndisPkt->dataPacket.dataLength);
-  mbuf_copyback(newPacket, 0, rndisPkt->dataPacket.dataLength, pktData, MBUF_WAITOK);
-  
-  _ethInterface->inputPacket(newPacket, rndisPkt->dataPacket.dataLength);
-  postCycle++;
+
+  //
+  // Pass stripped VLAN tag to the stack.
+  //
+  if (_isVlanSupported && getRNDISVlanTag(rndisPkt, &vlanTag)) {
+    setVlanTag(newPacket, vlanTag);
+  }
+
+  //
+  // Queue packet, the input queue is flushed to the stack once the channel has been drained.
+  //
+  _rxModerationPackets++;
+  cpuStats = getCPUStats();
+  OSIncrementAtomic64((SInt64 *)&cpuStats->rxPackets);
+  OSAddAtomic64(pktLength, (SInt64 *)&cpuStats->rxBytes);
+  _ethInterface->inputPacket(newPacket, pktLength, IONetworkInterface::kInputOptionQueuePacket);
 }
 
-HyperVNetworkRNDISRequest* HyperVNetwork::allocateRNDISRequest(size_t additionalLength) {
-  HyperVDMABuffer           dmaBuffer;
-  HyperVNetworkRNDISRequest *rndisRequest;
-  IOLock                    *lock;
-  
+bool HyperVNetwork::getRNDISVlanTag(HyperVNetworkRNDISMessage *rndisPkt, UInt32 *vlanTag) {
+  HyperVNetworkRNDISPerPacketInfo          *perPacketInfo;
+  HyperVNetworkRNDISPerPacketInfoIEEE8021Q *vlanInfo;
+  UInt8                                    *perPacketInfoData;
+  UInt32                                   perPacketInfoLength;
+
   //
-  // Allocate lock for waiting.
+  // Per-packet info must lie before the packet data.
   //
-  lock = IOLockAlloc();
-  if (lock == NULL) {
-    HVSYSLOG("Failed to allocate lock for RNDIS request");
-    return NULL;
+  perPacketInfoLength = rndisPkt->dataPacket.perPacketInfoLength;
+  if (perPacketInfoLength == 0
+      || ((UInt64)rndisPkt->dataPacket.perPacketInfoOffset + perPacketInfoLength) > rndisPkt->dataPacket.dataOffset) {
+    return false;
   }
-  
+  perPacketInfoData = ((UInt8 *)&rndisPkt->dataPacket) + rndisPkt->dataPacket.perPacketInfoOffset;
+
   //
-  // Create DMA buffer with required specifications and get physical address.
+  // Search for 802.1Q info.
   //
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&dmaBuffer, sizeof (HyperVNetworkRNDISRequest) + additionalLength)) {
-    HVSYSLOG("Failed to allocate buffer memory for RNDIS request");
-    IOLockFree(lock);
+  while (perPacketInfoLength >= sizeof (*perPacketInfo)) {
+    perPacketInfo = (HyperVNetworkRNDISPerPacketInfo *)perPacketInfoData;
+    if (perPacketInfo->size < sizeof (*perPacketInfo) || perPacketInfo->size > perPacketInfoLength) {
+      HVDBGLOG("Invalid per-packet info of %u bytes", perPacketInfo->size);
+      return false;
+    }
+
+    if ((perPacketInfo->type & ~kHyperVNetworkRNDISPerPacketInfoInternal) == kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q
+        && ((UInt64)perPacketInfo->perPacketInfoOffset + sizeof (*vlanInfo)) <= perPacketInfo->size) {
+      vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *)(perPacketInfoData + perPacketInfo->perPacketInfoOffset);
+      *vlanTag = (vlanInfo->priority << kHyperVNetworkVlanTagPriorityShift)
+               | (vlanInfo->cfi << kHyperVNetworkVlanTagCFIShift)
+               | vlanInfo->vlanId;
+      return true;
+    }
+
+    perPacketInfoData   += perPacketInfo->size;
+    perPacketInfoLength -= perPacketInfo->size;
   }
-  
-  rndisRequest = (HyperVNetworkRNDISRequest*)dmaBuffer.buffer;
-  memset(rndisRequest, 0, sizeof (HyperVNetworkRNDISRequest) + additionalLength);
-  
-  rndisRequest->lock = lock;
-  rndisRequest->isSleeping = false;
-  memcpy(&rndisRequest->dmaBuffer, &dmaBuffer, sizeof (rndisRequest->dmaBuffer));
-  HVDBGLOG("Mapped RNDIS request buffer 0x%llX to phys 0x%llX", rndisRequest, rndisRequest->dmaBuffer.physAddr);
-  
+  return false;
+}
+
+bool HyperVNetwork::allocateRNDISRequests() {
+  _rndisLock = IOLockAlloc();
+  if (_rndisLock == nullptr) {
+    HVSYSLOG("Failed to allocate RNDIS request lock");
+    return false;
+  }
+
+  _rndisRequests = (HyperVNetworkRNDISRequest *)IOMalloc(sizeof (*_rndisRequests) * kHyperVNetworkRNDISRequestCount);
+  if (_rndisRequests == nullptr) {
+    HVSYSLOG("Failed to allocate RNDIS requests");
+    return false;
+  }
+  bzero(_rndisRequests, sizeof (*_rndisRequests) * kHyperVNetworkRNDISRequestCount);
+
+  //
+  // Allocate a single page DMA buffer for each request slot.
+  //
+  for (UInt32 i = 0; i < kHyperVNetworkRNDISRequestCount; i++) {
+    if (!_hvDevice->getHvController()->allocateDmaBuffer(&_rndisRequests[i].dmaBuffer, PAGE_SIZE)) {
+      HVSYSLOG("Failed to allocate buffer memory for RNDIS request %u", i);
+      return false;
+    }
+    _rndisRequests[i].message = (HyperVNetworkRNDISMessage *)_rndisRequests[i].dmaBuffer.buffer;
+    HVDBGLOG("Mapped RNDIS request %u buffer 0x%llX to phys 0x%llX", i, _rndisRequests[i].message, _rndisRequests[i].dmaBuffer.physAddr);
+  }
+
+  //
+  // Create timer for expiring asynchronous requests.
+  //
+  _rndisTimerSource = IOTimerEventSource::timerEventSource(this,
+                                                           OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVNetwork::handleRNDISTimeout));
+  if (_rndisTimerSource == nullptr) {
+    HVSYSLOG("Failed to create RNDIS request timer");
+    return false;
+  }
+  getWorkLoop()->addEventSource(_rndisTimerSource);
+  _rndisTimerSource->enable();
+
+  return true;
+}
+
+void HyperVNetwork::freeRNDISRequests() {
+  if (_rndisTimerSource != nullptr) {
+    _rndisTimerSource->cancelTimeout();
+    _rndisTimerSource->disable();
+    getWorkLoop()->removeEventSource(_rndisTimerSource);
+    OSSafeReleaseNULL(_rndisTimerSource);
+  }
+
+  if (_rndisRequests != nullptr) {
+    for (UInt32 i = 0; i < kHyperVNetworkRNDISRequestCount; i++) {
+      _hvDevice->getHvController()->freeDmaBuffer(&_rndisRequests[i].dmaBuffer);
+    }
+    IOFree(_rndisRequests, sizeof (*_rndisRequests) * kHyperVNetworkRNDISRequestCount);
+    _rndisRequests = nullptr;
+  }
+
+  if (_rndisLock != nullptr) {
+    IOLockFree(_rndisLock);
+    _rndisLock = nullptr;
+  }
+}
+
+HyperVNetworkRNDISRequest* HyperVNetwork::allocateRNDISRequest(size_t additionalLength) {
+  HyperVNetworkRNDISRequest *rndisRequest = nullptr;
+
+  if (_rndisRequests == nullptr || (sizeof (HyperVNetworkRNDISMessage) + additionalLength) > PAGE_SIZE) {
+    return nullptr;
+  }
+
+  //
+  // Find a free request slot.
+  // Request ID contains a generation count so late responses to expired requests are not matched to a reused slot.
+  //
+  IOLockLock(_rndisLock);
+  for (UInt32 i = 0; i < kHyperVNetworkRNDISRequestCount; i++) {
+    if (!_rndisRequests[i].isActive) {
+      rndisRequest             = &_rndisRequests[i];
+      rndisRequest->isActive   = true;
+      rndisRequest->isSent     = false;
+      rndisRequest->isComplete = false;
+      rndisRequest->action     = nullptr;
+      rndisRequest->context    = nullptr;
+      rndisRequest->requestId  = (++_rndisGeneration << kHyperVNetworkRNDISRequestIdSlotShift) | i;
+      break;
+    }
+  }
+  IOLockUnlock(_rndisLock);
+
+  if (rndisRequest == nullptr) {
+    HVSYSLOG("No free RNDIS request slots");
+    return nullptr;
+  }
+
+  bzero(rndisRequest->message, PAGE_SIZE);
   return rndisRequest;
 }
 
 void HyperVNetwork::freeRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest) {
-  IOLockFree(rndisRequest->lock);
-  _hvDevice->getHvController()->freeDmaBuffer(&rndisRequest->dmaBuffer);
+  IOLockLock(_rndisLock);
+  rndisRequest->isActive = false;
+  IOLockUnlock(_rndisLock);
 }
 
-UInt32 HyperVNetwork::getNextRNDISTransId() {
-  IOLockLock(rndisLock);
-  UInt32 value = rndisTransId;
-  rndisTransId++;
-  IOLockUnlock(rndisLock);
-  return value;
-}
+IOReturn HyperVNetwork::sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, HyperVNetworkRNDISAction action, void *context) {
+  IOReturn              status;
+  UInt32                requestId;
+  VMBusSinglePageBuffer pageBuffer;
+  HyperVNetworkMessage  netMsg;
 
-bool HyperVNetwork::sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, bool waitResponse) {
   //
   // Create page buffer set.
   //
-  VMBusSinglePageBuffer pageBuffer;
-  pageBuffer.length = rndisRequest->message.header.length;
+  pageBuffer.length = rndisRequest->message->header.length;
   pageBuffer.offset = 0;
-  pageBuffer.pfn = rndisRequest->dmaBuffer.physAddr >> PAGE_SHIFT;
-  
+  pageBuffer.pfn    = rndisRequest->dmaBuffer.physAddr >> PAGE_SHIFT;
+
   //
   // Create packet for sending the RNDIS request.
+  // The VMBus completion for this packet is not waited on, only the RNDIS response is.
   //
-  HyperVNetworkMessage netMsg;
-  memset(&netMsg, 0, sizeof (netMsg));
-  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacket;
-  netMsg.v1.sendRNDISPacket.channelType = kHyperVNetworkRNDISChannelTypeControl;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = -1;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionSize = 0;
-  
-  rndisRequest->isSleeping = true;
-  rndisRequest->message.initRequest.requestId = getNextRNDISTransId();
-  
+  bzero(&netMsg, sizeof (netMsg));
+  netMsg.messageType                               = kHyperVNetworkMessageTypeV1SendRNDISPacket;
+  netMsg.v1.sendRNDISPacket.channelType            = kHyperVNetworkRNDISChannelTypeControl;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = kHyperVNetworkRNDISSendSectionIndexInvalid;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionSize  = 0;
+
   //
-  // Add to linked list.
+  // All request messages have the request ID as the first field.
   //
-  IOLockLock(rndisLock);
-  if (rndisRequests == NULL)
-    rndisRequests = rndisRequest;
-  else
-    rndisRequests->next = rndisRequest;
-  IOLockUnlock(rndisLock);
-  
-  _hvDevice->writeGPADirectSinglePagePacket(&netMsg, sizeof (netMsg), true, &pageBuffer, 1, &netMsg, sizeof (netMsg));
-  
-  IOLockLock(rndisRequest->lock);
-  while (rndisRequest->isSleeping) {
-    IOLockSleep(rndisRequest->lock, &rndisRequest->isSleeping, THREAD_INTERRUPTIBLE);
+  IOLockLock(_rndisLock);
+  requestId                                   = rndisRequest->requestId;
+  rndisRequest->message->initRequest.requestId = requestId;
+  rndisRequest->action                        = action;
+  rndisRequest->context                       = context;
+  rndisRequest->isSent                        = true;
+  clock_interval_to_deadline(kHyperVNetworkRNDISRequestTimeoutMS, kMillisecondScale, &rndisRequest->deadline);
+  IOLockUnlock(_rndisLock);
+
+  HVDBGLOG("Sending RNDIS request 0x%X of type 0x%X (%s)", requestId, rndisRequest->message->header.type, action != nullptr ? "async" : "sync");
+  status = _hvDevice->writeGPADirectSinglePagePacket(&netMsg, sizeof (netMsg), true, &pageBuffer, 1, nullptr, 0,
+                                                     (requestId & kHyperVNetworkRNDISRequestIdSlotMask) | kHyperVNetworkControlTransIdBits);
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send RNDIS request 0x%X with status 0x%X", requestId, status);
+    IOLockLock(_rndisLock);
+    rndisRequest->isSent = false;
+    IOLockUnlock(_rndisLock);
+    return status;
+  }
+
+  //
+  // Arm timer to expire asynchronous requests.
+  //
+  if (action != nullptr) {
+    IOLockLock(_rndisLock);
+    if (!_isRNDISTimerArmed) {
+      _isRNDISTimerArmed = true;
+      _rndisTimerSource->setTimeoutMS(kHyperVNetworkRNDISRequestTimeoutMS);
+    }
+    IOLockUnlock(_rndisLock);
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::waitRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest) {
+  int      result = THREAD_AWAKENED;
+  IOReturn status;
+
+  //
+  // Wait for response to arrive, or for the request to time out.
+  // This cannot be called on the work loop, as responses are delivered there.
+  //
+  IOLockLock(_rndisLock);
+  while (!rndisRequest->isComplete && result != THREAD_TIMED_OUT) {
+    result = IOLockSleepDeadline(_rndisLock, &rndisRequest->isComplete, *((AbsoluteTime *)&rndisRequest->deadline), THREAD_UNINT);
+  }
+  status = rndisRequest->isComplete ? kIOReturnSuccess : kIOReturnTimeout;
+  rndisRequest->isSent = false;
+  IOLockUnlock(_rndisLock);
+
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("RNDIS request 0x%X of type 0x%X timed out", rndisRequest->requestId, rndisRequest->message->header.type);
+  }
+  return status;
+}
+
+void HyperVNetwork::completeRNDISRequest(HyperVNetworkRNDISMessage *rndisResponse, UInt32 responseLength) {
+  HyperVNetworkRNDISRequest *rndisRequest;
+  HyperVNetworkRNDISAction  action;
+  void                      *context;
+  UInt32                    requestId = rndisResponse->initComplete.requestId;
+  UInt32                    slot      = requestId & kHyperVNetworkRNDISRequestIdSlotMask;
+
+  if (_rndisRequests == nullptr || slot >= kHyperVNetworkRNDISRequestCount) {
+    HVSYSLOG("Invalid RNDIS response for request 0x%X", requestId);
+    return;
+  }
+  rndisRequest = &_rndisRequests[slot];
+
+  //
+  // Ensure the request is still outstanding, it may have already timed out.
+  //
+  IOLockLock(_rndisLock);
+  if (!rndisRequest->isActive || !rndisRequest->isSent || rndisRequest->isComplete || rndisRequest->requestId != requestId) {
+    IOLockUnlock(_rndisLock);
+    HVDBGLOG("Ignoring RNDIS response for stale request 0x%X", requestId);
+    return;
+  }
+
+  //
+  // Copy response data into request buffer.
+  //
+  if (responseLength > PAGE_SIZE) {
+    responseLength = PAGE_SIZE;
+  }
+  memcpy(rndisRequest->message, rndisResponse, responseLength);
+  rndisRequest->isComplete = true;
+  action                   = rndisRequest->action;
+  context                  = rndisRequest->context;
+
+  //
+  // Wake synchronous waiter, it will free the request.
+  //
+  if (action == nullptr) {
+    IOLockUnlock(_rndisLock);
+    IOLockWakeup(_rndisLock, &rndisRequest->isComplete, true);
+    return;
+  }
+  IOLockUnlock(_rndisLock);
+
+  //
+  // Invoke completion action for asynchronous request and free it.
+  //
+  (this->*action)(kIOReturnSuccess, rndisRequest->message, context);
+  freeRNDISRequest(rndisRequest);
+}
+
+void HyperVNetwork::handleRNDISTimeout(IOTimerEventSource *sender) {
+  HyperVNetworkRNDISRequest *rndisRequest;
+  HyperVNetworkRNDISRequest *expiredRequests[kHyperVNetworkRNDISRequestCount];
+  UInt32                    expiredCount = 0;
+  UInt64                    currentTime;
+  bool                      isPending = false;
+
+  clock_get_uptime(&currentTime);
+
+  //
+  // Expire any asynchronous requests past their deadline.
+  // Synchronous requests expire on their own.
+  //
+  IOLockLock(_rndisLock);
+  for (UInt32 i = 0; i < kHyperVNetworkRNDISRequestCount; i++) {
+    rndisRequest = &_rndisRequests[i];
+    if (!rndisRequest->isActive || !rndisRequest->isSent || rndisRequest->isComplete || rndisRequest->action == nullptr) {
+      continue;
+    }
+    if (rndisRequest->deadline > currentTime) {
+      isPending = true;
+      continue;
+    }
+
+    rndisRequest->isComplete        = true;
+    expiredRequests[expiredCount++] = rndisRequest;
+  }
+
+  //
+  // Rearm timer if there are still requests outstanding.
+  // This is done before the expiry actions are invoked, as they may send new asynchronous requests that need the timer.
+  //
+  _isRNDISTimerArmed = isPending;
+  if (isPending) {
+    _rndisTimerSource->setTimeoutMS(kHyperVNetworkRNDISRequestTimeoutMS);
+  }
+  IOLockUnlock(_rndisLock);
+
+  for (UInt32 i = 0; i < expiredCount; i++) {
+    rndisRequest = expiredRequests[i];
+    HVSYSLOG("RNDIS request 0x%X of type 0x%X timed out", rndisRequest->requestId, rndisRequest->message->header.type);
+    (this->*(rndisRequest->action))(kIOReturnTimeout, nullptr, rndisRequest->context);
+    freeRNDISRequest(rndisRequest);
   }
-  IOLockUnlock(rndisRequest->lock);
-  
-  HVDBGLOG("woke");
-  
-  return true;
 }
 
 bool HyperVNetwork::initializeRNDIS() {
-  HyperVNetworkRNDISRequest *rndisRequest = allocateRNDISRequest();
-  rndisRequest->message.header.type   = kHyperVNetworkRNDISMessageTypeInit;
-  rndisRequest->message.header.length = sizeof (HyperVNetworkRNDISMessageInitializeRequest) + 8;
+  HyperVNetworkRNDISRequest *rndisRequest;
+  bool                      result;
+
+  rndisRequest = allocateRNDISRequest();
+  if (rndisRequest == nullptr) {
+    return false;
+  }
+
+  rndisRequest->message->header.type   = kHyperVNetworkRNDISMessageTypeInit;
+  rndisRequest->message->header.length = sizeof (rndisRequest->message->header) + sizeof (rndisRequest->message->initRequest);
   
-  rndisRequest->message.initRequest.majorVersion    = kHyperVNetworkRNDISVersionMajor;
-  rndisRequest->message.initRequest.minorVersion    = kHyperVNetworkRNDISVersionMinor;
-  rndisRequest->message.initRequest.maxTransferSize = kHyperVNetworkRNDISMaxTransferSize;
+  rndisRequest->message->initRequest.majorVersion    = kHyperVNetworkRNDISVersionMajor;
+  rndisRequest->message->initRequest.minorVersion    = kHyperVNetworkRNDISVersionMinor;
+  rndisRequest->message->initRequest.maxTransferSize = kHyperVNetworkRNDISMaxTransferSize;
   
-  bool result = sendRNDISRequest(rndisRequest);
+  result = sendRNDISRequest(rndisRequest) == kIOReturnSuccess && waitRNDISRequest(rndisRequest) == kIOReturnSuccess;
   if (result) {
     HVDBGLOG("RNDIS initializated with status 0x%X, max packets per msg %u, max transfer size 0x%X, packet alignment 0x%X",
-             rndisRequest->message.initComplete.status, rndisRequest->message.initComplete.maxPacketsPerMessage,
-             rndisRequest->message.initComplete.maxTransferSize, rndisRequest->message.initComplete.packetAlignmentFactor);
-    result = rndisRequest->message.initComplete.status == kHyperVNetworkRNDISStatusSuccess;
+             rndisRequest->message->initComplete.status, rndisRequest->message->initComplete.maxPacketsPerMessage,
+             rndisRequest->message->initComplete.maxTransferSize, rndisRequest->message->initComplete.packetAlignmentFactor);
+    result = rndisRequest->message->initComplete.status == kHyperVNetworkRNDISStatusSuccess;
+
+    //
+    // Configure transmit aggregation limits from what the host supports.
+    //
+    if (result) {
+      _txAggregateMaxPackets = rndisRequest->message->initComplete.maxPacketsPerMessage;
+      if (_txAggregateMaxPackets > kHyperVNetworkTransmitAggregateMaxPackets) {
+        _txAggregateMaxPackets = kHyperVNetworkTransmitAggregateMaxPackets;
+      } else if (_txAggregateMaxPackets == 0) {
+        _txAggregateMaxPackets = 1;
+      }
+
+      _txAggregateMaxLength = _sendSectionSize;
+      if (rndisRequest->message->initComplete.maxTransferSize != 0
+          && rndisRequest->message->initComplete.maxTransferSize < _txAggregateMaxLength) {
+        _txAggregateMaxLength = rndisRequest->message->initComplete.maxTransferSize;
+      }
+
+      _txAggregateAlignment = 1;
+      if (rndisRequest->message->initComplete.packetAlignmentFactor < PAGE_SHIFT) {
+        _txAggregateAlignment = 1 << rndisRequest->message->initComplete.packetAlignmentFactor;
+      }
+      HVDBGLOG("Transmit aggregation up to %u packets and %u bytes with alignment of %u bytes",
+               _txAggregateMaxPackets, _txAggregateMaxLength, _txAggregateAlignment);
+    }
   } else {
     HVSYSLOG("Failed to send RNDIS initialization request");
   }
@@ -208,59 +475,104 @@ bool HyperVNetwork::initializeRNDIS() {
   return result;
 }
 
-IOReturn HyperVNetwork::getRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize) {
+HyperVNetworkRNDISRequest* HyperVNetwork::createRNDISGetOIDRequest(HyperVNetworkRNDISOID oid) {
   HyperVNetworkRNDISRequest *rndisRequest;
-  bool                      result;
-  IOReturn                  status;
-
-  if (value == nullptr || valueSize == nullptr) {
-    return kIOReturnBadArgument;
-  }
 
   //
   // Allocate RNDIS request.
   //
   rndisRequest = allocateRNDISRequest();
   if (rndisRequest == nullptr) {
-    return kIOReturnNoResources;
+    return nullptr;
   }
 
   //
   // Get specified RNDIS OID.
   //
-  rndisRequest->message.header.type                    = kHyperVNetworkRNDISMessageTypeGetOID;
-  rndisRequest->message.header.length                  = sizeof (rndisRequest->message.header) + sizeof (rndisRequest->message.getOIDRequest);
-  rndisRequest->message.getOIDRequest.oid              = oid;
-  rndisRequest->message.getOIDRequest.infoBufferOffset = sizeof (rndisRequest->message.getOIDRequest);
-  rndisRequest->message.getOIDRequest.infoBufferLength = 0;
-  rndisRequest->message.getOIDRequest.deviceVcHandle   = 0;
+  rndisRequest->message->header.type                    = kHyperVNetworkRNDISMessageTypeGetOID;
+  rndisRequest->message->header.length                  = sizeof (rndisRequest->message->header) + sizeof (rndisRequest->message->getOIDRequest);
+  rndisRequest->message->getOIDRequest.oid              = oid;
+  rndisRequest->message->getOIDRequest.infoBufferOffset = sizeof (rndisRequest->message->getOIDRequest);
+  rndisRequest->message->getOIDRequest.infoBufferLength = 0;
+  rndisRequest->message->getOIDRequest.deviceVcHandle   = 0;
+  return rndisRequest;
+}
+
+HyperVNetworkRNDISRequest* HyperVNetwork::createRNDISSetOIDRequest(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize) {
+  HyperVNetworkRNDISRequest *rndisRequest;
+
+  //
+  // Allocate RNDIS request.
+  //
+  rndisRequest = allocateRNDISRequest(valueSize);
+  if (rndisRequest == nullptr) {
+    return nullptr;
+  }
+
+  //
+  // Set specified RNDIS OID.
+  //
+  rndisRequest->message->header.type                    = kHyperVNetworkRNDISMessageTypeSetOID;
+  rndisRequest->message->header.length                  = sizeof (rndisRequest->message->header) + sizeof (rndisRequest->message->setOIDRequest) + valueSize;
+  rndisRequest->message->setOIDRequest.oid              = oid;
+  rndisRequest->message->setOIDRequest.infoBufferOffset = sizeof (rndisRequest->message->setOIDRequest);
+  rndisRequest->message->setOIDRequest.infoBufferLength = valueSize;
+  rndisRequest->message->setOIDRequest.deviceVcHandle   = 0;
+  
+  //
+  // Copy OID data from buffer to RNDIS request.
+  //
+  memcpy((UInt8*)(&rndisRequest->message->setOIDRequest) + rndisRequest->message->setOIDRequest.infoBufferOffset, value, valueSize);
+  return rndisRequest;
+}
+
+IOReturn HyperVNetwork::getRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize) {
+  HyperVNetworkRNDISRequest *rndisRequest;
+  IOReturn                  status;
+  UInt32                    infoBufferOffset;
+  UInt32                    infoBufferLength;
+
+  if (value == nullptr || valueSize == nullptr) {
+    return kIOReturnBadArgument;
+  }
+
+  rndisRequest = createRNDISGetOIDRequest(oid);
+  if (rndisRequest == nullptr) {
+    return kIOReturnNoResources;
+  }
 
   HVDBGLOG("Getting OID 0x%X", oid);
-  result = sendRNDISRequest(rndisRequest);
-  if (result && rndisRequest->message.getOIDComplete.status == kHyperVNetworkRNDISStatusSuccess) {
-    HVDBGLOG("Got OID 0x%X data at offset 0x%X (%u bytes)", oid,
-             rndisRequest->message.getOIDComplete.infoBufferOffset, rndisRequest->message.getOIDComplete.infoBufferLength);
-    
+  status = sendRNDISRequest(rndisRequest);
+  if (status == kIOReturnSuccess) {
+    status = waitRNDISRequest(rndisRequest);
+  }
+
+  if (status == kIOReturnSuccess && rndisRequest->message->getOIDComplete.status == kHyperVNetworkRNDISStatusSuccess) {
+    infoBufferOffset = rndisRequest->message->getOIDComplete.infoBufferOffset;
+    infoBufferLength = rndisRequest->message->getOIDComplete.infoBufferLength;
+    HVDBGLOG("Got OID 0x%X data at offset 0x%X (%u bytes)", oid, infoBufferOffset, infoBufferLength);
+
     //
     // Copy OID data from RNDIS request to buffer.
     //
-    if (*valueSize >= rndisRequest->message.getOIDComplete.infoBufferLength) {
-      memcpy(value, (UInt8*)(&rndisRequest->message.getOIDComplete) + rndisRequest->message.getOIDComplete.infoBufferOffset,
-             rndisRequest->message.getOIDComplete.infoBufferLength);
+    if (((UInt64)sizeof (rndisRequest->message->header) + infoBufferOffset + infoBufferLength) > PAGE_SIZE) {
+      HVSYSLOG("OID 0x%X data is outside of response", oid);
+      status = kIOReturnIOError;
+    } else if (*valueSize >= infoBufferLength) {
+      memcpy(value, (UInt8*)(&rndisRequest->message->getOIDComplete) + infoBufferOffset, infoBufferLength);
       status = kIOReturnSuccess;
     } else {
-      HVDBGLOG("OID value of %u bytes is too large for buffer of %u bytes", rndisRequest->message.getOIDComplete.infoBufferLength, *valueSize);
+      HVDBGLOG("OID value of %u bytes is too large for buffer of %u bytes", infoBufferLength, *valueSize);
       status = kIOReturnMessageTooLarge;
     }
-    *valueSize = rndisRequest->message.getOIDComplete.infoBufferLength;
+    *valueSize = infoBufferLength;
 
-  } else if (result) {
-    HVDBGLOG("Failed to get OID 0x%X with status 0x%X", oid, rndisRequest->message.getOIDComplete.status);
+  } else if (status == kIOReturnSuccess) {
+    HVDBGLOG("Failed to get OID 0x%X with status 0x%X", oid, rndisRequest->message->getOIDComplete.status);
     status = kIOReturnIOError;
 
   } else {
     HVDBGLOG("Failed to get OID 0x%X", oid);
-    status = kIOReturnIOError;
   }
 
   freeRNDISRequest(rndisRequest);
@@ -269,52 +581,77 @@ IOReturn HyperVNetwork::getRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt
 
 IOReturn HyperVNetwork::setRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize) {
   HyperVNetworkRNDISRequest *rndisRequest;
-  bool                      result;
   IOReturn                  status;
 
   if (value == nullptr || valueSize == 0) {
     return kIOReturnBadArgument;
   }
 
-  //
-  // Allocate RNDIS request.
-  //
-  rndisRequest = allocateRNDISRequest(valueSize);
+  rndisRequest = createRNDISSetOIDRequest(oid, value, valueSize);
   if (rndisRequest == nullptr) {
     return kIOReturnNoResources;
   }
 
-  //
-  // Set specified RNDIS OID.
-  //
-  rndisRequest->message.header.type                    = kHyperVNetworkRNDISMessageTypeSetOID;
-  rndisRequest->message.header.length                  = sizeof (rndisRequest->message.header) + sizeof (rndisRequest->message.setOIDRequest);
-  rndisRequest->message.setOIDRequest.oid              = oid;
-  rndisRequest->message.setOIDRequest.infoBufferOffset = sizeof (rndisRequest->message.setOIDRequest);
-  rndisRequest->message.setOIDRequest.infoBufferLength = valueSize;
-  rndisRequest->message.setOIDRequest.deviceVcHandle   = 0;
-  
-  //
-  // Copy OID data from buffer to RNDIS request.
-  //
-  memcpy((UInt8*)(&rndisRequest->message.setOIDRequest) + rndisRequest->message.setOIDRequest.infoBufferOffset, value, valueSize);
-
   HVDBGLOG("Setting OID 0x%X of %u bytes", oid, valueSize);
-  result = sendRNDISRequest(rndisRequest);
-  if (result && rndisRequest->message.setOIDComplete.status == kHyperVNetworkRNDISStatusSuccess) {
-    HVDBGLOG("Set OID 0x%X of %u bytes", oid, valueSize);
+  status = sendRNDISRequest(rndisRequest);
+  if (status == kIOReturnSuccess) {
+    status = waitRNDISRequest(rndisRequest);
+  }
 
-    status = kIOReturnSuccess;
+  if (status == kIOReturnSuccess && rndisRequest->message->setOIDComplete.status == kHyperVNetworkRNDISStatusSuccess) {
+    HVDBGLOG("Set OID 0x%X of %u bytes", oid, valueSize);
 
-  } else if (result) {
-    HVDBGLOG("Failed to set OID 0x%X with status 0x%X", oid, rndisRequest->message.setOIDComplete.status);
+  } else if (status == kIOReturnSuccess) {
+    HVDBGLOG("Failed to set OID 0x%X with status 0x%X", oid, rndisRequest->message->setOIDComplete.status);
     status = kIOReturnIOError;
 
   } else {
     HVDBGLOG("Failed to set OID 0x%X", oid);
-    status = kIOReturnIOError;
   }
 
   freeRNDISRequest(rndisRequest);
   return status;
 }
+
+IOReturn HyperVNetwork::getRNDISOIDAsync(HyperVNetworkRNDISOID oid, HyperVNetworkRNDISAction action, void *context) {
+  HyperVNetworkRNDISRequest *rndisRequest;
+  IOReturn                  status;
+
+  if (action == nullptr) {
+    return kIOReturnBadArgument;
+  }
+
+  rndisRequest = createRNDISGetOIDRequest(oid);
+  if (rndisRequest == nullptr) {
+    return kIOReturnNoResources;
+  }
+
+  HVDBGLOG("Getting OID 0x%X asynchronously", oid);
+  status = sendRNDISRequest(rndisRequest, action, context);
+  if (status != kIOReturnSuccess) {
+    freeRNDISRequest(rndisRequest);
+  }
+  return status;
+}
+
+IOReturn HyperVNetwork::setRNDISOIDAsync(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize,
+                                         HyperVNetworkRNDISAction action, void *context) {
+  HyperVNetworkRNDISRequest *rndisRequest;
+  IOReturn                  status;
+
+  if (value == nullptr || valueSize == 0 || action == nullptr) {
+    return kIOReturnBadArgument;
+  }
+
+  rndisRequest = createRNDISSetOIDRequest(oid, value, valueSize);
+  if (rndisRequest == nullptr) {
+    return kIOReturnNoResources;
+  }
+
+  HVDBGLOG("Setting OID 0x%X of %u bytes asynchronously", oid, valueSize);
+  status = sendRNDISRequest(rndisRequest, action, context);
+  if (status != kIOReturnSuccess) {
+    freeRNDISRequest(rndisRequest);
+  }
+  return status;
+}
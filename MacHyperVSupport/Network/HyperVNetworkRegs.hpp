@@ -13,16 +13,109 @@
 #define kHyperVNetworkNDISVersion60001    0x00060001
 #define kHyperVNetworkNDISVersion6001E    0x0006001E
 
+//
+// Default and allowed send/receive buffer sizes.
+// Sizes can be overridden in MB using boot arguments.
+//
 #define kHyperVNetworkReceiveBufferSize         (1024 * 1024 * 16)
 #define kHyperVNetworkReceiveBufferSizeLegacy   (1024 * 1024 * 15)
+#define kHyperVNetworkReceiveBufferSizeMin      (1024 * 1024 * 2)
+#define kHyperVNetworkReceiveBufferSizeMax      (1024 * 1024 * 31)
 #define kHyperVNetworkSendBufferSize            (1024 * 1024 * 15)
+#define kHyperVNetworkSendBufferSizeMin         (1024 * 1024 * 1)
+#define kHyperVNetworkSendBufferSizeMax         (1024 * 1024 * 15)
+
+#define kHyperVNetworkReceiveBufferSizeBootArg  "hvnetrxbufsize"
+#define kHyperVNetworkSendBufferSizeBootArg     "hvnettxbufsize"
+
+//
+// Maximum number of receive buffer sections accepted from Hyper-V.
+//
+#define kHyperVNetworkReceiveSectionMax         4
 
 #define kHyperVNetworkReceivePacketSize         (16 * PAGE_SIZE)
 
+//
+// Transmit queue parameters.
+// Transmits are stalled if the ring buffer has less than the minimum free space.
+//
+#define kHyperVNetworkTransmitQueueSize         1024
+#define kHyperVNetworkTransmitRingMinFreeSpace  1024
+
+//
+// Packets larger than the copy limit are sent directly from the mbuf pages using GPA direct packets.
+// The RNDIS header uses up to two page buffers. Segments are not page aligned, so each may be split into two page buffers.
+//
+#define kHyperVNetworkTransmitCopyMaxSize       PAGE_SIZE
+#define kHyperVNetworkTransmitMaxSegments       ((kVMBusMaxPageBufferCount - 2) / 2)
+#define kHyperVNetworkTransmitMaxPacketSize     (kHyperVNetworkTransmitMaxSegments * PAGE_SIZE)
+
+//
+// Maximum number of RNDIS packets aggregated into a single send section.
+// The host-advertised limit is used if lower.
+//
+#define kHyperVNetworkTransmitAggregateMaxPackets 8
+
+//
+// Zero-copy receive parameters.
+// Frames smaller than the copy break are copied into a new mbuf, larger frames are
+// loaned to the stack directly from the receive buffer until the loan limit is reached.
+// Loan limit is a fraction of the receive buffer size.
+//
+#define kHyperVNetworkReceiveCopyBreak          256
+#define kHyperVNetworkReceiveLoanCount          512
+#define kHyperVNetworkReceiveLoanMaxShift       1
+
+//
+// Adaptive receive interrupt moderation.
+// Receive rate is sampled each window, switching to polled mode above the high rate and back below the low rate.
+// Poll interval bounds the added receive latency.
+//
+#define kHyperVNetworkRxModerationWindowMS      10
+#define kHyperVNetworkRxModerationHighRate      20000
+#define kHyperVNetworkRxModerationLowRate       5000
+#define kHyperVNetworkRxPollIntervalUS          250
+
+//
+// Opt-in busy-poll receive mode for latency sensitive workloads.
+// Boot argument specifies the spin budget in microseconds.
+//
+#define kHyperVNetworkBusyPollBootArg           "hvnetbusypoll"
+#define kHyperVNetworkBusyPollMaxUS             1000
+
+//
+// MTU sizes, not including the Ethernet header and CRC.
+//
+#define kHyperVNetworkMTUDefault                1500
+#define kHyperVNetworkMTUMaximum                9000
+#define kHyperVNetworkEthernetHeaderSize        14
+
 #define MBit 1000000
 
-#define kHyperVNetworkMaximumTransId  0xFFFFFFFF
-#define kHyperVNetworkSendTransIdBits 0xFA00000000000000
+//
+// Per-CPU statistics are padded to a cache line to avoid false sharing.
+//
+#define kHyperVNetworkStatsCacheLineSize        64
+
+//
+// Host statistics are published to this property, and are queried at most once per interval.
+//
+#define kHyperVNetworkStatisticsKey             "HyperVStatistics"
+#define kHyperVNetworkHostStatsIntervalMS       1000
+
+#define kHyperVNetworkMaximumTransId      0xFFFFFFFF
+#define kHyperVNetworkTransIdTypeMask     0xFF00000000000000
+#define kHyperVNetworkSendTransIdBits     0xFA00000000000000
+#define kHyperVNetworkControlTransIdBits  0xFB00000000000000
+
+//
+// RNDIS control requests.
+// Each request slot is a single page, request IDs contain the slot index in the low bits.
+//
+#define kHyperVNetworkRNDISRequestCount         16
+#define kHyperVNetworkRNDISRequestIdSlotMask    0xFF
+#define kHyperVNetworkRNDISRequestIdSlotShift   8
+#define kHyperVNetworkRNDISRequestTimeoutMS     5000
 
 //
 // Protocol versions.
@@ -55,7 +148,10 @@ typedef enum : UInt32 {
   kHyperVNetworkMessageTypeV1SendSendBufferComplete,
   kHyperVNetworkMessageTypeV1RevokeSendBuffer,
   kHyperVNetworkMessageTypeV1SendRNDISPacket,
-  kHyperVNetworkMessageTypeV1SendRNDISPacketComplete
+  kHyperVNetworkMessageTypeV1SendRNDISPacketComplete,
+
+  // Protocol version 2.
+  kHyperVNetworkMessageTypeV2SendNDISConfig               = 125
 } HyperVNetworkMessageType;
 
 //
@@ -238,6 +334,41 @@ typedef union __attribute__((packed)) {
   HyperVNetworkV1MessageSendRNDISPacketComplete     sendRNDISPacketComplete;
 } HyperVNetworkV1Message;
 
+//
+// Protocol version 2
+//
+
+//
+// NDIS configuration capabilities.
+//
+typedef enum : UInt64 {
+  kHyperVNetworkV2CapabilityVMQ           = BIT(0),
+  kHyperVNetworkV2CapabilityChimney       = BIT(1),
+  kHyperVNetworkV2CapabilitySRIOV         = BIT(2),
+  kHyperVNetworkV2CapabilityIEEE8021Q     = BIT(3),
+  kHyperVNetworkV2CapabilityCorrelationId = BIT(4),
+  kHyperVNetworkV2CapabilityTeaming       = BIT(5),
+  kHyperVNetworkV2CapabilityVirtualSubnet = BIT(6),
+  kHyperVNetworkV2CapabilityRSC           = BIT(7)
+} HyperVNetworkV2Capability;
+
+//
+// Send NDIS configuration to Hyper-V.
+// MTU includes the Ethernet header.
+//
+typedef struct __attribute__((packed)) {
+  UInt32  mtu;
+  UInt32  reserved;
+  UInt64  capabilities;
+} HyperVNetworkV2MessageSendNDISConfig;
+
+//
+// Protocol version 2 messages.
+//
+typedef union __attribute__((packed)) {
+  HyperVNetworkV2MessageSendNDISConfig              sendNDISConfig;
+} HyperVNetworkV2Message;
+
 //
 // Main message structure.
 //
@@ -246,6 +377,7 @@ typedef struct __attribute__((packed)) {
   union {
     HyperVNetworkMessageInit    init;
     HyperVNetworkV1Message      v1;
+    HyperVNetworkV2Message      v2;
   } __attribute__((packed));
   UInt8 padd[sizeof (HyperVNetworkMessageInit)]; // TODO: required for now for some reason, otherwise Hyper-V rejects message
 } HyperVNetworkMessage;
@@ -312,6 +444,59 @@ typedef struct {
   UInt32 reserved;
 } HyperVNetworkRNDISMessageDataPacket;
 
+//
+// Per-packet info types.
+//
+typedef enum : UInt32 {
+  kHyperVNetworkRNDISPerPacketInfoTypeTCPIPChecksum         = 0,
+  kHyperVNetworkRNDISPerPacketInfoTypeIPSec                 = 1,
+  kHyperVNetworkRNDISPerPacketInfoTypeTCPLargeSend          = 2,
+  kHyperVNetworkRNDISPerPacketInfoTypeClassificationHandle  = 3,
+  kHyperVNetworkRNDISPerPacketInfoTypeReserved              = 4,
+  kHyperVNetworkRNDISPerPacketInfoTypeScatterGatherList     = 5,
+  kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q             = 6,
+  kHyperVNetworkRNDISPerPacketInfoTypeOriginalPacket        = 7,
+  kHyperVNetworkRNDISPerPacketInfoTypePacketCancelId        = 8
+} HyperVNetworkRNDISPerPacketInfoType;
+
+//
+// Per-packet info header.
+// Info data offset is from the beginning of this header.
+//
+typedef struct {
+  UInt32                              size;
+  HyperVNetworkRNDISPerPacketInfoType type;
+  UInt32                              perPacketInfoOffset;
+} HyperVNetworkRNDISPerPacketInfo;
+
+//
+// 802.1Q VLAN per-packet info.
+//
+typedef union {
+  struct {
+    UInt32 priority : 3;
+    UInt32 cfi      : 1;
+    UInt32 vlanId   : 12;
+    UInt32 reserved : 16;
+  };
+  UInt32 value;
+} HyperVNetworkRNDISPerPacketInfoIEEE8021Q;
+
+#define kHyperVNetworkRNDISPerPacketInfoInternal  BIT(31)
+
+//
+// 802.1Q tag control information layout.
+//
+#define kHyperVNetworkVlanTagPriorityShift        13
+#define kHyperVNetworkVlanTagCFIShift             12
+#define kHyperVNetworkVlanTagIdMask               0xFFF
+
+//
+// Largest RNDIS header that precedes packet data, including all per-packet info used.
+//
+#define kHyperVNetworkRNDISDataPacketMaxHeaderLength (sizeof (HyperVNetworkRNDISMessageHeader) + sizeof (HyperVNetworkRNDISMessageDataPacket) \
+  + sizeof (HyperVNetworkRNDISPerPacketInfo) + sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q))
+
 //
 // Initialization message.
 //
@@ -407,6 +592,23 @@ typedef enum : UInt32 {
   kHyperVNetworkRNDISLinkStateDisconnted
 } HyperVNetworkRNDISLinkState;
 
+//
+// Packet filter flags used with OID_GEN_CURRENT_PACKET_FILTER.
+//
+typedef enum : UInt32 {
+  kHyperVNetworkRNDISPacketFilterDirected     = 0x1,
+  kHyperVNetworkRNDISPacketFilterMulticast    = 0x2,
+  kHyperVNetworkRNDISPacketFilterAllMulticast = 0x4,
+  kHyperVNetworkRNDISPacketFilterBroadcast    = 0x8,
+  kHyperVNetworkRNDISPacketFilterPromiscuous  = 0x20
+} HyperVNetworkRNDISPacketFilter;
+
+//
+// Maximum multicast addresses programmed into the host filter.
+// All multicast traffic is received if more addresses are required.
+//
+#define kHyperVNetworkMulticastListMax          32
+
 //
 // Get OID request message.
 //
@@ -102,10 +102,18 @@ bool HyperVVMBus::attach(IOService *provider) {
     
     result = true;
   } while (false);
-  
+
+  if (!result) {
+    freeRegisterDeviceThreads();
+  }
   return result;
 }
 
+void HyperVVMBus::detach(IOService *provider) {
+  freeRegisterDeviceThreads();
+  super::detach(provider);
+}
+
 bool HyperVVMBus::sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType, VMBusChannelMessage *response) {
   if (responseType != kVMBusChannelMessageTypeInvalid && response == NULL) {
     return false;
@@ -125,13 +133,28 @@ IOReturn HyperVVMBus::sendVMBusMessageGated(VMBusChannelMessage *message, UInt32
   HypercallStatus hvStatus = kHypercallStatusSuccess;
   IOReturn returnStatus = kIOReturnSuccess;
   bool postCompleted = false;
+  UInt32 retryDelayUS = 1;
+  AbsoluteTime retryDeadline;
   
   const VMBusMessageTypeTableEntry *msgEntry = &VMBusMessageTypeTable[message->header.type];
   UInt32 size = messageSize != NULL ? *messageSize : msgEntry->size;
+  VMBusResponseWaiter waiter;
+  
+  //
+  // Register for the response before posting, so it cannot be missed.
+  //
+  waiter.responseType    = *responseType;
+  waiter.responseKey     = getVMBusMessageKey(message);
+  waiter.responseMessage = responseMessage;
+  waiter.isCompleted     = false;
+  if (waiter.responseType != kVMBusChannelMessageTypeInvalid) {
+    waiter.next           = _vmbusResponseWaiters;
+    _vmbusResponseWaiters = &waiter;
+  }
   
   //
   // Multiple hypercalls may fail due to lack of resources on the host
-  // side, just try again if that happens.
+  // side, back off exponentially and try again if that happens.
   //
   for (int i = 0; i < kHyperVHypercallRetryCount; i++) {
     HVDBGLOG("Sending message on connection ID %u, type %u, %u bytes", _vmbusMsgConnectionId, msgEntry->type, size);
@@ -156,75 +179,131 @@ IOReturn HyperVVMBus::sendVMBusMessageGated(VMBusChannelMessage *message, UInt32
     if (postCompleted) {
       break;
     }
-    IODelay(10);
+
+    //
+    // Longer delays sleep on the gate with a deadline, releasing it so incoming
+    // management messages can still be processed while host buffers free up.
+    //
+    if (retryDelayUS >= 1000) {
+      clock_interval_to_deadline(retryDelayUS, kMicrosecondScale, &retryDeadline);
+      _cmdGate->commandSleep(&retryDeadline, retryDeadline, THREAD_UNINT);
+    } else {
+      IODelay(retryDelayUS);
+    }
+    if (retryDelayUS < kHyperVHypercallRetryMaxDelayUS) {
+      retryDelayUS <<= 1;
+    }
   }
   
   if (returnStatus != kIOReturnSuccess) {
     HVSYSLOG("Hypercall message type 0x%X failed with status 0x%X", msgEntry->type, hvStatus);
+    for (VMBusResponseWaiter **waiterLink = &_vmbusResponseWaiters; *waiterLink != nullptr; waiterLink = &(*waiterLink)->next) {
+      if (*waiterLink == &waiter) {
+        *waiterLink = waiter.next;
+        break;
+      }
+    }
     return returnStatus;
   }
   
-  if (*responseType != kVMBusChannelMessageTypeInvalid) {
+  if (waiter.responseType != kVMBusChannelMessageTypeInvalid) {
     //
-    // Wait for response.
+    // Wait for response, other messages may be sent while this one is outstanding.
     //
-    _vmbusWaitForMessageType = *responseType;
-    _cmdGate->commandSleep(&_cmdGateEvent);
-
-    HVDBGLOG("Awoken from sleep, message type is %u with size %u", _vmbusWaitMessage.type, _vmbusWaitMessage.size);
-    memcpy(responseMessage, _vmbusWaitMessage.data, VMBusMessageTypeTable[*responseType].size);
+    while (!waiter.isCompleted) {
+      _cmdGate->commandSleep(&waiter, THREAD_UNINT);
+    }
+    HVDBGLOG("Awoken from sleep for response type %u with key 0x%X", waiter.responseType, waiter.responseKey);
   }
   
   return kIOReturnSuccess;
 }
 
-void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
+UInt32 HyperVVMBus::getVMBusMessageKey(VMBusChannelMessage *message) {
   //
-  // Sometimes the interrupt will fire for the same message, and by the time this
-  // handler is invoked for that second interrupt, the message will be cleared.
+  // Requests and their responses both carry the channel ID or GPADL handle they refer to.
+  // Connection and channel enumeration messages can only have one outstanding wait.
   //
-  HyperVMessage *vmbusMessage = hvController->getPendingMessage(cpu, kVMBusInterruptMessage);
-  if (vmbusMessage->type == kHyperVMessageTypeNone) {
-    return;
+  switch (message->header.type) {
+    case kVMBusChannelMessageTypeChannelOpen:
+      return ((VMBusChannelMessageChannelOpen*) message)->channelId;
+    case kVMBusChannelMessageTypeChannelOpenResponse:
+      return ((VMBusChannelMessageChannelOpenResponse*) message)->channelId;
+    case kVMBusChannelMessageTypeGPADLHeader:
+      return ((VMBusChannelMessageGPADLHeader*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLBody:
+      return ((VMBusChannelMessageGPADLBody*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLCreated:
+      return ((VMBusChannelMessageGPADLCreated*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLTeardown:
+      return ((VMBusChannelMessageGPADLTeardown*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLTeardownResponse:
+      return ((VMBusChannelMessageGPADLTeardownResponse*) message)->gpadl;
+    default:
+      return 0;
   }
+}
+
+bool HyperVVMBus::completeVMBusResponseWaiter(VMBusChannelMessage *message) {
+  VMBusResponseWaiter **waiterLink;
+  VMBusResponseWaiter *waiter;
+  UInt32              responseKey;
   
-  HVDBGLOG("CPU %u has a message (type %u)", cpu, vmbusMessage->type);
+  if (message->header.type >= kVMBusChannelMessageTypeMax) {
+    return false;
+  }
+  responseKey = getVMBusMessageKey(message);
   
-  //
-  // Check if we are waiting for an incoming VMBus message.
-  //
-  if (vmbusMessage->type == kHyperVMessageTypeChannel) {
-    VMBusChannelMessage *msg = (VMBusChannelMessage*) &vmbusMessage->data[0];
-    HVDBGLOG("Incoming VMBus message type %u on CPU %u", msg->header.type, cpu);
-    
-    if (_vmbusWaitForMessageType != kVMBusChannelMessageTypeInvalid && _vmbusWaitForMessageType == msg->header.type) {
-      HVDBGLOG("Woke for response %u", _vmbusWaitForMessageType);
-      _vmbusWaitForMessageType = kVMBusChannelMessageTypeInvalid;
-      
-      //
-      // Store message response.
-      //
-      memcpy(&_vmbusWaitMessage, vmbusMessage, sizeof (_vmbusWaitMessage));
-      hvController->sendSynICEOM(cpu);
-      
-      _cmdGate->commandWakeup(&_cmdGateEvent);
-      return;
+  for (waiterLink = &_vmbusResponseWaiters; *waiterLink != nullptr; waiterLink = &(*waiterLink)->next) {
+    waiter = *waiterLink;
+    if (waiter->responseType != message->header.type || waiter->responseKey != responseKey) {
+      continue;
     }
     
+    HVDBGLOG("Woke for response %u with key 0x%X", waiter->responseType, responseKey);
+    *waiterLink = waiter->next;
+    memcpy(waiter->responseMessage, message, VMBusMessageTypeTable[waiter->responseType].size);
+    waiter->isCompleted = true;
+    _cmdGate->commandWakeup(waiter);
+    return true;
+  }
+  return false;
+}
+
+void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
+  HyperVMessage vmbusMessage;
+
+  //
+  // Messages were copied out of the SynIC message slot by the controller in interrupt context.
+  // Sometimes the interrupt will fire for messages that were already processed, nothing will be dequeued then.
+  //
+  while (hvController->dequeueSynICMessage(cpu, &vmbusMessage)) {
+    HVDBGLOG("CPU %u has a message (type %u)", cpu, vmbusMessage.type);
+
     //
-    // Add offered channels to array.
+    // Check if we are waiting for an incoming VMBus message.
     //
-    if (msg->header.type == kVMBusChannelMessageTypeChannelOffer) {
-      addVMBusDevice((VMBusChannelMessageChannelOffer*) msg);
-    } else if (msg->header.type == kVMBusChannelMessageTypeRescindChannelOffer) {
-      removeVMBusDevice((VMBusChannelMessageChannelRescindOffer*) msg);
-    } else {
-      HVDBGLOG("Unknown message type %u", msg->header.type);
+    if (vmbusMessage.type == kHyperVMessageTypeChannel) {
+      VMBusChannelMessage *msg = (VMBusChannelMessage*) &vmbusMessage.data[0];
+      HVDBGLOG("Incoming VMBus message type %u on CPU %u", msg->header.type, cpu);
+
+      if (completeVMBusResponseWaiter(msg)) {
+        continue;
+      }
+
+      //
+      // Add offered channels to array.
+      //
+      if (msg->header.type == kVMBusChannelMessageTypeChannelOffer) {
+        addVMBusDevice((VMBusChannelMessageChannelOffer*) msg);
+      } else if (msg->header.type == kVMBusChannelMessageTypeRescindChannelOffer) {
+        removeVMBusDevice((VMBusChannelMessageChannelRescindOffer*) msg);
+      } else {
+        HVDBGLOG("Unknown message type %u", msg->header.type);
+      }
+    } else if (vmbusMessage.type == kVMBusConnIdEvent) {
+      HVDBGLOG("Incoming VMBus event on CPU %u", cpu);
     }
-    hvController->sendSynICEOM(cpu);
-    
-  } else if (vmbusMessage->type == kVMBusConnIdEvent) {
-    HVDBGLOG("Incoming VMBus event on CPU %u", cpu);
   }
 }
 
@@ -303,6 +382,7 @@ bool HyperVVMBus::scanVMBus() {
   chanReqMsg.header.type = kVMBusChannelMessageTypeRequestChannels;
   
   HVDBGLOG("VMBus scan started");
+  _vmbusScanStartTime = mach_absolute_time();
   VMBusChannelMessage resp;
   bool result = sendVMBusMessage(&chanReqMsg, kVMBusChannelMessageTypeRequestChannelsDone, &resp);
   HVDBGLOG("VMBus scan completed");
@@ -328,13 +408,6 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
   memcpy(_vmbusChannels[channelId].instanceId, offerMessage->instance, sizeof (offerMessage->instance));
   _vmbusChannels[channelId].status = kVMBusChannelStatusClosed;
   
-  if (!registerVMBusDevice(&_vmbusChannels[channelId])) {
-    HVDBGLOG("Failed to register channel %u", channelId);
-    cleanupVMBusDevice(&_vmbusChannels[channelId]);
-    return false;
-  }
-  
-  HVDBGLOG("Registered channel %u (%s)", channelId, _vmbusChannels[channelId].typeGuidString);
   HVDBGLOG("Channel %u flags 0x%X, MIMO size %u bytes, pipe mode 0x%X", channelId,
            _vmbusChannels[channelId].offerMessage.flags, _vmbusChannels[channelId].offerMessage.mmioSizeMegabytes,
            _vmbusChannels[channelId].offerMessage.pipe.mode);
@@ -342,6 +415,9 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
            _vmbusChannels[channelId].offerMessage.monitorId, _vmbusChannels[channelId].offerMessage.monitorAllocated,
            _vmbusChannels[channelId].offerMessage.dedicatedInterrupt, _vmbusChannels[channelId].offerMessage.connectionId);
 
+  //
+  // Signaling parameters must be set before the child can start.
+  //
   if (_vmbusVersion > kVMBusVersionWS2008) {
     _vmbusChannels[channelId].useDedicatedInterrupt = _vmbusChannels[channelId].offerMessage.dedicatedInterrupt != 0;
     _vmbusChannels[channelId].connectionSignalId    = _vmbusChannels[channelId].offerMessage.connectionId;
@@ -350,6 +426,21 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
     _vmbusChannels[channelId].connectionSignalId    = kVMBusConnIdEvent;
   }
 
+  //
+  // Register the nub outside of the message path, allowing remaining offers to be processed
+  // while children start and negotiate with the host.
+  //
+  if (_vmbusChannels[channelId].registerDeviceThread == nullptr) {
+    _vmbusChannels[channelId].registerDeviceThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVVMBus::handleRegisterVMBusDevice), this);
+    if (_vmbusChannels[channelId].registerDeviceThread == nullptr) {
+      HVSYSLOG("Failed to allocate registration thread for channel %u", channelId);
+      cleanupVMBusDevice(&_vmbusChannels[channelId]);
+      return false;
+    }
+  }
+  _vmbusChannels[channelId].isRescinded = false;
+  thread_call_enter1(_vmbusChannels[channelId].registerDeviceThread, &_vmbusChannels[channelId]);
+
   return true;
 }
 
@@ -364,7 +455,14 @@ void HyperVVMBus::removeVMBusDevice(VMBusChannelMessageChannelRescindOffer *resc
   
   //
   // Notify nub to terminate.
+  // If the nub has not been registered yet, cancel its registration. If registration is already running,
+  // the nub is dropped once it reaches the gate, waiting for it here would deadlock on the gate.
   //
+  _vmbusChannels[channelId].isRescinded = true;
+  if (_vmbusChannels[channelId].registerDeviceThread != nullptr
+      && thread_call_cancel(_vmbusChannels[channelId].registerDeviceThread)) {
+    cleanupVMBusDevice(&_vmbusChannels[channelId]);
+  }
   if (_vmbusChannels[channelId].deviceNub != NULL) {
     _vmbusChannels[channelId].deviceNub->terminate();
     _vmbusChannels[channelId].deviceNub->release();
@@ -373,13 +471,13 @@ void HyperVVMBus::removeVMBusDevice(VMBusChannelMessageChannelRescindOffer *resc
   HVDBGLOG("Channel %u has been asked to terminate", channelId);
 }
 
-bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
+HyperVVMBusDevice* HyperVVMBus::createVMBusDevice(VMBusChannel *channel) {
   //
   // Allocate and initialize child VMBus device object.
   //
   HyperVVMBusDevice *childDevice = OSTypeAlloc(HyperVVMBusDevice);
   if (childDevice == nullptr) {
-    return false;
+    return nullptr;
   }
 
   //
@@ -397,7 +495,7 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
     OSSafeReleaseNULL(channelNumber);
     OSSafeReleaseNULL(mmioBytesNumber);
     childDevice->release();
-    return false;
+    return nullptr;
   }
 
   //
@@ -410,7 +508,7 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
     channelNumber->release();
     childDevice->release();
     OSSafeReleaseNULL(mmioBytesNumber);
-    return false;
+    return nullptr;
   }
 
   bool result = dict->setObject(kHyperVVMBusDeviceChannelTypeKey, devType) &&
@@ -428,13 +526,13 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
   if (!result) {
     dict->release();
     childDevice->release();
-    return false;
+    return nullptr;
   }
 
   if (!hvController->addInterruptProperties(dict, channel->offerMessage.channelId)) {
     dict->release();
     childDevice->release();
-    return false;
+    return nullptr;
   }
 
   //
@@ -445,13 +543,81 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
 
   if (!result) {
     childDevice->release();
-    return false;
+    return nullptr;
+  }
+
+  return childDevice;
+}
+
+IOReturn HyperVVMBus::publishVMBusDeviceGated(VMBusChannel *channel, HyperVVMBusDevice *childDevice) {
+  //
+  // Channel may have been rescinded while the nub was being created.
+  //
+  if (childDevice == nullptr || channel->isRescinded) {
+    cleanupVMBusDevice(channel);
+    return kIOReturnAborted;
   }
 
-  childDevice->registerService();
   channel->deviceNub = childDevice;
+  childDevice->registerService();
+  return kIOReturnSuccess;
+}
 
-  return true;
+void HyperVVMBus::handleRegisterVMBusDevice(VMBusChannel *channel) {
+  UInt32 channelId = channel->offerMessage.channelId;
+  UInt64 startTime;
+  UInt64 endTime;
+  UInt64 registerTimeNS;
+  UInt64 scanTimeNS;
+  HyperVVMBusDevice *childDevice;
+  IOReturn status;
+
+  startTime = mach_absolute_time();
+  childDevice = createVMBusDevice(channel);
+  if (childDevice == nullptr) {
+    HVSYSLOG("Failed to create nub for channel %u", channelId);
+  }
+
+  status = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::publishVMBusDeviceGated), channel, childDevice);
+  if (status != kIOReturnSuccess) {
+    HVDBGLOG("Channel %u was not registered with status 0x%X", channelId, status);
+    if (childDevice != nullptr) {
+      childDevice->detach(this);
+      childDevice->release();
+    }
+    return;
+  }
+  endTime = mach_absolute_time();
+
+  //
+  // Trace registration time, and time since the scan started, for boot profiling.
+  //
+  absolutetime_to_nanoseconds(endTime - startTime, &registerTimeNS);
+  absolutetime_to_nanoseconds(endTime - _vmbusScanStartTime, &scanTimeNS);
+  HVDBGLOG("Registered channel %u (%s) in %llu us, %llu us after scan start", channelId, channel->typeGuidString,
+           registerTimeNS / 1000, scanTimeNS / 1000);
+}
+
+void HyperVVMBus::freeRegisterDeviceThreads() {
+  thread_call_t registerDeviceThread;
+
+  //
+  // Wait for any running registration to finish before the thread calls are freed.
+  //
+  for (UInt32 i = 0; i < kVMBusMaxChannels; i++) {
+    registerDeviceThread = _vmbusChannels[i].registerDeviceThread;
+    if (registerDeviceThread == nullptr) {
+      continue;
+    }
+
+    while (thread_call_isactive(registerDeviceThread)) {
+      if (thread_call_cancel_wait(registerDeviceThread)) {
+        cleanupVMBusDevice(&_vmbusChannels[i]);
+      }
+    }
+    thread_call_free(registerDeviceThread);
+    _vmbusChannels[i].registerDeviceThread = nullptr;
+  }
 }
 
 void HyperVVMBus::cleanupVMBusDevice(VMBusChannel *channel) {
@@ -61,10 +61,26 @@ typedef struct {
   
   //
   // I/O Kit nub for VMBus device.
+  // Nubs are created and registered on a per-channel thread call, so children start concurrently.
+  // Nub is published and rescinds are processed under the command gate.
   //
   HyperVVMBusDevice               *deviceNub;
+  thread_call_t                   registerDeviceThread;
+  bool                            isRescinded;
 } VMBusChannel;
 
+//
+// Outstanding wait for a VMBus management response.
+// Responses are matched on type and on the channel ID or GPADL handle they refer to.
+//
+typedef struct VMBusResponseWaiter {
+  struct VMBusResponseWaiter  *next;
+  VMBusChannelMessageType     responseType;
+  UInt32                      responseKey;
+  VMBusChannelMessage         *responseMessage;
+  bool                        isCompleted;
+} VMBusResponseWaiter;
+
 class HyperVVMBus : public IOService {
   OSDeclareDefaultStructors(HyperVVMBus);
   HVDeclareLogFunctions("vmbus");
@@ -98,18 +114,16 @@ private:
   HyperVDMABuffer     _vmbusMnf2 = { };
   
   //
-  // Flag used for waiting for incoming message response.
-  // 0 = disable.
+  // Outstanding waits for incoming message responses.
+  // Protected by the command gate, incoming messages are processed on the same work loop.
   //
-  UInt8               _vmbusWaitForMessageType = 0;
-  UInt32              _vmbusWaitMessageCpu = 0;
-  HyperVMessage       _vmbusWaitMessage = { };
+  VMBusResponseWaiter *_vmbusResponseWaiters = nullptr;
   
   IOCommandGate           *_cmdGate = nullptr;
   bool                    _cmdShouldWake = false;
-  bool                    _cmdGateEvent = false;
   
   
+  UInt64                  _vmbusScanStartTime   = 0;
   UInt32                  _nextGpadlHandle      = kHyperVGpadlNullHandle;
   UInt32                  _vmbusVersion         = 0;
   UInt16                  _vmbusMsgConnectionId = 0;
@@ -134,12 +148,17 @@ private:
   bool sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType = kVMBusChannelMessageTypeInvalid, VMBusChannelMessage *response = NULL);
   bool sendVMBusMessageWithSize(VMBusChannelMessage *message, UInt32 messageSize, VMBusChannelMessageType responseType = kVMBusChannelMessageTypeInvalid, VMBusChannelMessage *response = NULL);
   IOReturn sendVMBusMessageGated(VMBusChannelMessage *message, UInt32 *messageSize, VMBusChannelMessageType *responseType, VMBusChannelMessage *response);
+  UInt32 getVMBusMessageKey(VMBusChannelMessage *message);
+  bool completeVMBusResponseWaiter(VMBusChannelMessage *message);
   bool connectVMBus();
   bool negotiateVMBus(UInt32 version);
   bool scanVMBus();
   bool addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage);
   void removeVMBusDevice(VMBusChannelMessageChannelRescindOffer *rescindOfferMessage);
-  bool registerVMBusDevice(VMBusChannel *channel);
+  HyperVVMBusDevice *createVMBusDevice(VMBusChannel *channel);
+  IOReturn publishVMBusDeviceGated(VMBusChannel *channel, HyperVVMBusDevice *childDevice);
+  void handleRegisterVMBusDevice(VMBusChannel *channel);
+  void freeRegisterDeviceThreads();
   void cleanupVMBusDevice(VMBusChannel *channel);
   
   //
@@ -148,12 +167,15 @@ private:
   
 
   void freeVMBusChannel(UInt32 channelId);
+  IOReturn initVMBusChannelGPADLGated(UInt32 *channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle,
+                                      VMBusChannelMessageGPADLCreated *gpadlCreated);
   
 public:
   //
   // IOService overrides.
   //
   bool attach(IOService *provider) APPLE_KEXT_OVERRIDE;
+  void detach(IOService *provider) APPLE_KEXT_OVERRIDE;
   
   //
   // Misc functions.
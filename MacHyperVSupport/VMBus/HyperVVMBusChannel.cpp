@@ -64,9 +64,17 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   //
   // Allocate channel ring buffers.
   // TX and RX ring buffers are allocated and provided to Hyper-V as a single large buffer.
+  // Ring buffers are only accessed through the GPADL and do not need to be physically contiguous.
   //
-  getHvController()->allocateDmaBuffer(&channel->dataBuffer, totalBufferSize);
-  getHvController()->allocateDmaBuffer(&channel->eventBuffer, PAGE_SIZE);
+  if (!getHvController()->allocateDmaBuffer(&channel->dataBuffer, totalBufferSize, false)) {
+    HVSYSLOG("Failed to allocate ring buffers for channel %u", channelId);
+    return kIOReturnNoResources;
+  }
+  if (!getHvController()->allocateDmaBuffer(&channel->eventBuffer, PAGE_SIZE)) {
+    HVSYSLOG("Failed to allocate event buffer for channel %u", channelId);
+    getHvController()->freeDmaBuffer(&channel->dataBuffer);
+    return kIOReturnNoResources;
+  }
   
   //
   // Configure GPADL for channel.
@@ -178,19 +186,7 @@ IOReturn HyperVVMBus::closeVMBusChannel(UInt32 channelId) {
 }
 
 IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle) {
-  bool result;
-  
-  UInt32 pageCount;
-  UInt32 pfnSize;
-  UInt32 pageHeaderCount;
-  UInt32 messageSize;
-  UInt64 physPageIndex;
-  UInt32 pagesRemaining;
-  UInt32 pagesBodyCount;
-  bool needsMultipleMessages;
-  
-  VMBusChannelMessageGPADLHeader  *gpadlHeader;
-  VMBusChannelMessageGPADLBody    *gpadlBody;
+  IOReturn                        status;
   VMBusChannelMessageGPADLCreated gpadlCreated;
   
   //
@@ -209,9 +205,8 @@ IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *d
   //
   // Maximum number of pages allowed is 8190 (8192 - 2 for TX and RX headers).
   //
-  pageCount = (UInt32)(dmaBuffer->size >> PAGE_SHIFT);
-  if (pageCount > kHyperVMaxGpadlPages) {
-    HVDBGLOG("%u is above the maximum supported number of GPADL pages");
+  if ((dmaBuffer->size >> PAGE_SHIFT) > kHyperVMaxGpadlPages) {
+    HVDBGLOG("%u is above the maximum supported number of GPADL pages", (UInt32)(dmaBuffer->size >> PAGE_SHIFT));
     return kIOReturnBadArgument;
   }
   
@@ -220,63 +215,96 @@ IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *d
   //
   *gpadlHandle = OSIncrementAtomic(&_nextGpadlHandle);
   
+  //
+  // Post the header and all body messages within a single gate hold.
+  //
+  status = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::initVMBusChannelGPADLGated),
+                               &channelId, dmaBuffer, gpadlHandle, &gpadlCreated);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+  
+  HVDBGLOG("GPADL creation response for channel %u: 0x%X", channelId, gpadlCreated.status);
+  if (gpadlCreated.status != kHyperVStatusSuccess) {
+    HVSYSLOG("Failed to create GPADL for channel %u", channelId);
+    return kIOReturnIOError;
+  }
+  
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBus::initVMBusChannelGPADLGated(UInt32 *channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle,
+                                                 VMBusChannelMessageGPADLCreated *gpadlCreated) {
+  IOReturn status;
+  
+  UInt32 pageCount;
+  UInt32 pfnSize;
+  UInt32 pageHeaderCount;
+  UInt32 messageSize;
+  UInt32 pageIndex;
+  UInt32 pagesRemaining;
+  UInt32 pagesBodyCount;
+  bool needsMultipleMessages;
+  VMBusChannelMessageType responseType;
+  
+  //
+  // Header and body messages are built in the same buffer, as each post copies the message into the hypercall page.
+  //
+  UInt64                          messageData[kHyperVMessageDataSize / sizeof (UInt64)];
+  VMBusChannelMessageGPADLHeader  *gpadlHeader = (VMBusChannelMessageGPADLHeader*) messageData;
+  VMBusChannelMessageGPADLBody    *gpadlBody   = (VMBusChannelMessageGPADLBody*) messageData;
+  
   //
   // For larger GPADL requests, a GPADL header and one or more GPADL body messages are required.
   // Otherwise we can use just the GPADL header.
   //
+  pageCount = (UInt32)(dmaBuffer->size >> PAGE_SHIFT);
   pfnSize = kHyperVMessageDataSize - sizeof (VMBusChannelMessageGPADLHeader) - sizeof (HyperVGPARange);
   pageHeaderCount = pfnSize / sizeof (UInt64);
   needsMultipleMessages = pageCount > pageHeaderCount;
   HVDBGLOG("Configuring GPADL handle 0x%X for channel %u of %u pages, multiple messages: %u",
-           *gpadlHandle, channelId, pageCount, needsMultipleMessages);
+           *gpadlHandle, *channelId, pageCount, needsMultipleMessages);
   
   //
   // Create GPADL header message.
   //
   messageSize = sizeof (VMBusChannelMessageGPADLHeader) + sizeof (HyperVGPARange) + (pageHeaderCount * sizeof (UInt64));
-  gpadlHeader = (VMBusChannelMessageGPADLHeader*) IOMalloc(messageSize);
-  if (gpadlHeader == nullptr) {
-    HVSYSLOG("Failed to allocate GPADL header message for channel %u", channelId);
-    return kIOReturnNoResources;
-  }
-  bzero(gpadlHeader, messageSize);
+  bzero(messageData, messageSize);
   
   //
   // Header will contain the first batch of GPADL PFNs.
   //
   gpadlHeader->header.type         = kVMBusChannelMessageTypeGPADLHeader;
-  gpadlHeader->channelId           = channelId;
+  gpadlHeader->channelId           = *channelId;
   gpadlHeader->gpadl               = *gpadlHandle;
   gpadlHeader->rangeCount          = kHyperVGpadlRangeCount;
   gpadlHeader->rangeBufferLength   = sizeof (HyperVGPARange) + (pageCount * sizeof (UInt64)); // Max page count is 8190.
   gpadlHeader->range[0].byteOffset = 0;
   gpadlHeader->range[0].byteCount  = (UInt32)dmaBuffer->size;
 
-  physPageIndex = dmaBuffer->physAddr >> PAGE_SHIFT;
-  for (UInt32 i = 0; i < pageHeaderCount; i++) {
-    gpadlHeader->range[0].pfnArray[i] = physPageIndex;
-    physPageIndex++;
+  //
+  // Buffer pages may not be contiguous, get each page frame number from the buffer.
+  //
+  pageIndex = 0;
+  for (UInt32 i = 0; i < pageHeaderCount && pageIndex < pageCount; i++) {
+    gpadlHeader->range[0].pfnArray[i] = getHvController()->getDmaBufferPhysAddr(dmaBuffer, (size_t)pageIndex << PAGE_SHIFT) >> PAGE_SHIFT;
+    pageIndex++;
   }
   
   //
   // Send GPADL header message.
   // If there are multiple messages required, wait for response after the last one.
   //
-  if (needsMultipleMessages) {
-    result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlHeader, messageSize);
-  } else {
-    result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlHeader, messageSize,
-                                      kVMBusChannelMessageTypeGPADLCreated, (VMBusChannelMessage*) &gpadlCreated);
-  }
-  IOFree(gpadlHeader, messageSize);
-  if (!result) {
-    HVSYSLOG("Failed to send GPADL header message for channel %u", channelId);
-    return kIOReturnIOError; // TODO:
+  responseType = needsMultipleMessages ? kVMBusChannelMessageTypeInvalid : kVMBusChannelMessageTypeGPADLCreated;
+  status = sendVMBusMessageGated((VMBusChannelMessage*) gpadlHeader, &messageSize, &responseType, (VMBusChannelMessage*) gpadlCreated);
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send GPADL header message for channel %u", *channelId);
+    return status;
   }
   
   if (needsMultipleMessages) {
     //
-    // Send rest of GPADL pages as body messages.
+    // Send rest of GPADL pages as body messages, back to back.
     //
     pagesRemaining = pageCount - pageHeaderCount;
     while (pagesRemaining > 0) {
@@ -287,46 +315,29 @@ IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *d
       }
       
       messageSize = (UInt32) (sizeof (VMBusChannelMessageGPADLBody) + (pagesBodyCount * sizeof (UInt64)));
-      gpadlBody = (VMBusChannelMessageGPADLBody*) IOMalloc(messageSize);
-      if (gpadlBody == nullptr) {
-        HVSYSLOG("Failed to allocate GPADL body message for channel %u", channelId);
-        return kIOReturnNoResources;
-      }
-      bzero(gpadlBody, messageSize);
+      bzero(messageData, sizeof (VMBusChannelMessageGPADLBody));
       
       gpadlBody->header.type = kVMBusChannelMessageTypeGPADLBody;
       gpadlBody->gpadl       = *gpadlHandle;
       for (UInt32 i = 0; i < pagesBodyCount; i++) {
-        gpadlBody->pfn[i] = physPageIndex;
-        physPageIndex++;
+        gpadlBody->pfn[i] = getHvController()->getDmaBufferPhysAddr(dmaBuffer, (size_t)pageIndex << PAGE_SHIFT) >> PAGE_SHIFT;
+        pageIndex++;
       }
       
-      HVDBGLOG("Processed %u body pages for for channel %u, %u remaining", pagesBodyCount, channelId, pagesRemaining);
       pagesRemaining -= pagesBodyCount;
       
       //
       // Send body message.
       // For the last one, we want to wait for the creation response.
       //
-      if (pagesRemaining == 0) {
-        result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlBody, messageSize,
-                                          kVMBusChannelMessageTypeGPADLCreated, (VMBusChannelMessage*) &gpadlCreated);
-      } else {
-        result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlBody, messageSize);
-      }
-
-      IOFree(gpadlBody, messageSize);
-      if (!result) {
-        HVSYSLOG("Failed to send GPADL body message for channel %u", channelId);
-        return kIOReturnIOError;
+      responseType = (pagesRemaining == 0) ? kVMBusChannelMessageTypeGPADLCreated : kVMBusChannelMessageTypeInvalid;
+      status = sendVMBusMessageGated((VMBusChannelMessage*) gpadlBody, &messageSize, &responseType, (VMBusChannelMessage*) gpadlCreated);
+      if (status != kIOReturnSuccess) {
+        HVSYSLOG("Failed to send GPADL body message for channel %u", *channelId);
+        return status;
       }
     }
-  }
-  
-  HVDBGLOG("GPADL creation response for channel %u: 0x%X", channelId, gpadlCreated.status);
-  if (gpadlCreated.status != kHyperVStatusSuccess) {
-    HVSYSLOG("Failed to create GPADL for channel %u", channelId);
-    return kIOReturnIOError;
+    HVDBGLOG("Sent %u body pages for channel %u", pageCount - pageHeaderCount, *channelId);
   }
   
   return kIOReturnSuccess;
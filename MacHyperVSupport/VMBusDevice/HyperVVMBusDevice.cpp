@@ -184,19 +184,72 @@ IOReturn HyperVVMBusDevice::installPacketActions(OSObject *target, PacketReadyAc
     }
     _workLoop->addEventSource(_interruptSource);
     _interruptSource->enable();
+
+    //
+    // Create timer for polled receive mode.
+    //
+    if (getHvController()->isSyntheticTimerSupported()) {
+      _rxPollSTimerSource = HyperVSyntheticTimer::timerEventSource(getHvController(), this,
+                                                                   OSMemberFunctionCast(HyperVSyntheticTimer::Action, this, &HyperVVMBusDevice::handleRxPollTimer));
+    }
+    if (_rxPollSTimerSource != nullptr) {
+      _workLoop->addEventSource(_rxPollSTimerSource);
+      _rxPollSTimerSource->enable();
+    } else {
+      _rxPollTimerSource = IOTimerEventSource::timerEventSource(this,
+                                                                OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVVMBusDevice::handleRxPollTimer));
+      if (_rxPollTimerSource == nullptr) {
+        HVSYSLOG("Failed to create RX poll timer for channel %u", _channelId);
+        _interruptSource->disable();
+        _workLoop->removeEventSource(_interruptSource);
+        OSSafeReleaseNULL(_interruptSource);
+        IOFree(_rxPacketBuffer, _rxPacketBufferLength);
+        return kIOReturnNoResources;
+      }
+      _workLoop->addEventSource(_rxPollTimerSource);
+      _rxPollTimerSource->enable();
+    }
   }
 
   HVDBGLOG("Data ready action handler installed (register interrupt: %u)", registerInterrupt);
   return kIOReturnSuccess;
 }
 
+void HyperVVMBusDevice::installPacketDrainAction(PacketDrainAction packetDrainAction) {
+  //
+  // Drain action is invoked on the packet action target once the RX buffer has been emptied.
+  //
+  _packetDrainAction = packetDrainAction;
+}
+
 void HyperVVMBusDevice::uninstallPacketActions() {
+  _isRxPolling = false;
+  disableRxBusyPoll();
+  if (_rxBusyPollThread != nullptr) {
+    stopRxBusyPoll();
+    thread_call_free(_rxBusyPollThread);
+    _rxBusyPollThread = nullptr;
+  }
+
+  if (_rxPollSTimerSource != nullptr) {
+    _rxPollSTimerSource->disable();
+    _workLoop->removeEventSource(_rxPollSTimerSource);
+    OSSafeReleaseNULL(_rxPollSTimerSource);
+  }
+  if (_rxPollTimerSource != nullptr) {
+    _rxPollTimerSource->cancelTimeout();
+    _rxPollTimerSource->disable();
+    _workLoop->removeEventSource(_rxPollTimerSource);
+    OSSafeReleaseNULL(_rxPollTimerSource);
+  }
+
   if (_interruptSource != nullptr) {
     _interruptSource->disable();
     _workLoop->removeEventSource(_interruptSource);
     OSSafeReleaseNULL(_interruptSource);
   }
   
+  _packetDrainAction  = nullptr;
   _wakePacketAction   = nullptr;
   _packetReadyAction  = nullptr;
   _packetActionTarget = nullptr;
@@ -207,6 +260,78 @@ void HyperVVMBusDevice::uninstallPacketActions() {
   }
 }
 
+IOReturn HyperVVMBusDevice::enableRxPolling(UInt32 intervalUS) {
+  if ((_rxPollSTimerSource == nullptr && _rxPollTimerSource == nullptr) || !_shouldFlushPackets || intervalUS == 0) {
+    return kIOReturnUnsupported;
+  }
+
+  //
+  // Interrupts are masked on the next pass through the RX buffer, and are then left masked.
+  // RX buffer is then checked every interval instead.
+  //
+  _rxPollIntervalUS = intervalUS;
+  _isRxPolling      = true;
+  HVDBGLOG("RX polling enabled with interval of %u us", intervalUS);
+  return kIOReturnSuccess;
+}
+
+void HyperVVMBusDevice::disableRxPolling() {
+  //
+  // Interrupts are unmasked on the next poll.
+  //
+  _isRxPolling = false;
+  HVDBGLOG("RX polling disabled");
+}
+
+IOReturn HyperVVMBusDevice::enableRxBusyPoll(UInt32 budgetUS) {
+  if (_interruptSource == nullptr || !_shouldFlushPackets || budgetUS == 0) {
+    return kIOReturnUnsupported;
+  }
+
+  if (_rxBusyPollThread == nullptr) {
+    _rxBusyPollThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVVMBusDevice::handleRxBusyPoll), this);
+    if (_rxBusyPollThread == nullptr) {
+      HVSYSLOG("Failed to create RX busy-poll thread for channel %u", _channelId);
+      return kIOReturnNoResources;
+    }
+  }
+
+  //
+  // Busy-polling starts after the next pass through the RX buffer.
+  //
+  _rxBusyPollBudgetUS = budgetUS;
+  HVDBGLOG("RX busy-polling enabled with budget of %u us", budgetUS);
+  return kIOReturnSuccess;
+}
+
+void HyperVVMBusDevice::disableRxBusyPoll() {
+  if (_rxBusyPollBudgetUS == 0) {
+    return;
+  }
+  stopRxBusyPoll();
+
+  //
+  // Interrupts may have been left masked by a cancelled busy-poll, run through the RX buffer to unmask them.
+  //
+  if (_channelIsOpen && _interruptSource != nullptr) {
+    _interruptSource->interruptOccurred(nullptr, this, 0);
+  }
+  HVDBGLOG("RX busy-polling disabled");
+}
+
+void HyperVVMBusDevice::stopRxBusyPoll() {
+  //
+  // Clear the budget under the gate so the interrupt handler cannot schedule another busy-poll,
+  // then wait for a running busy-poll to finish before the ring buffers or event sources are torn down.
+  //
+  _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::stopRxBusyPollGated));
+  if (_rxBusyPollThread != nullptr) {
+    while (thread_call_isactive(_rxBusyPollThread)) {
+      thread_call_cancel_wait(_rxBusyPollThread);
+    }
+  }
+}
+
 void HyperVVMBusDevice::triggerPacketAction() {
   if (_packetActionTarget == nullptr) {
     return;
@@ -251,6 +376,7 @@ IOReturn HyperVVMBusDevice::closeVMBusChannel() {
   if (!_channelIsOpen) {
     return kIOReturnSuccess;
   }
+  stopRxBusyPoll();
   _channelIsOpen = false;
   
   //
@@ -354,7 +480,7 @@ IOReturn HyperVVMBusDevice::writeInbandPacketWithTransactionId(void *buffer, UIn
 
 IOReturn HyperVVMBusDevice::writeGPADirectSinglePagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
                                                            VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
-                                                           void *responseBuffer, UInt32 responseBufferLength) {
+                                                           void *responseBuffer, UInt32 responseBufferLength, UInt64 transactionId) {
   if (pageBufferCount > kVMBusMaxPageBufferCount) {
     return kIOReturnNoResources;
   }
@@ -362,7 +488,9 @@ IOReturn HyperVVMBusDevice::writeGPADirectSinglePagePacket(void *buffer, UInt32
   //
   // Create packet for single page buffers.
   //
-  UInt64 transactionId = getNextTransId();
+  if (transactionId == 0) {
+    transactionId = getNextTransId();
+  }
   VMBusPacketSinglePageBuffer pagePacket;
   UInt32 pagePacketLength = sizeof (VMBusPacketSinglePageBuffer) -
     ((kVMBusMaxPageBufferCount - pageBufferCount) * sizeof (VMBusSinglePageBuffer));
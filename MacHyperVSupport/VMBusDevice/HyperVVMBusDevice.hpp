@@ -14,6 +14,7 @@
 #include <IOKit/IOService.h>
 
 #include "HyperVVMBus.hpp"
+#include "HyperVSyntheticTimer.hpp"
 #include "HyperV.hpp"
 #include "VMBus.hpp"
 
@@ -43,6 +44,7 @@ public:
   //
   typedef void (*PacketReadyAction)(void *target, VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
   typedef bool (*WakePacketAction)(void *target, VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
+  typedef void (*PacketDrainAction)(void *target);
 
 #if DEBUG
   typedef void (*TimerDebugAction)(void *target);
@@ -68,8 +70,25 @@ private:
   OSObject               *_packetActionTarget = nullptr;
   PacketReadyAction     _packetReadyAction    = nullptr;
   WakePacketAction      _wakePacketAction     = nullptr;
+  PacketDrainAction     _packetDrainAction    = nullptr;
   bool                  _shouldFlushPackets   = true;
 
+  //
+  // Polled receive mode.
+  // A synthetic timer is used where supported, for intervals below the system timer resolution.
+  //
+  HyperVSyntheticTimer  *_rxPollSTimerSource  = nullptr;
+  IOTimerEventSource    *_rxPollTimerSource   = nullptr;
+  UInt32                _rxPollIntervalUS     = 0;
+  bool                  _isRxPolling          = false;
+
+  //
+  // Busy-poll receive mode.
+  // After a drain, the RX buffer is spun on for a budget before interrupts are unmasked.
+  //
+  thread_call_t         _rxBusyPollThread     = nullptr;
+  volatile UInt32       _rxBusyPollBudgetUS   = 0;
+
   //
   // Ring buffers for channel.
   //
@@ -144,6 +163,10 @@ private:
 
 private:
   void handleInterrupt(IOInterruptEventSource *sender, int count);
+  void handleRxPollTimer(IOEventSource *sender);
+  void handleRxBusyPoll();
+  void stopRxBusyPoll();
+  IOReturn stopRxBusyPollGated();
   IOReturn openVMBusChannelGated(UInt32 *txBufferSize, UInt32 *rxBufferSize);
 
 public:
@@ -160,7 +183,14 @@ public:
   //
   IOReturn installPacketActions(OSObject *target, PacketReadyAction packetReadyAction, WakePacketAction wakePacketAction,
                                 UInt32 initialResponseBufferLength, bool registerInterrupt = true, bool flushPackets = true);
+  void installPacketDrainAction(PacketDrainAction packetDrainAction);
   void uninstallPacketActions();
+  IOReturn enableRxPolling(UInt32 intervalUS);
+  void disableRxPolling();
+  inline bool isRxPolling() { return _isRxPolling; }
+  IOReturn enableRxBusyPoll(UInt32 budgetUS);
+  void disableRxBusyPoll();
+  inline bool isRxBusyPolling() { return _rxBusyPollBudgetUS != 0; }
   void triggerPacketAction();
   IOReturn openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId = UINT64_MAX);
   IOReturn closeVMBusChannel();
@@ -214,7 +244,7 @@ public:
                                               void *responseBuffer = NULL, UInt32 responseBufferLength = 0);
   IOReturn writeGPADirectSinglePagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
                                           VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
-                                          void *responseBuffer = NULL, UInt32 responseBufferLength = 0);
+                                          void *responseBuffer = NULL, UInt32 responseBufferLength = 0, UInt64 transactionId = 0);
   IOReturn writeGPADirectMultiPagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
                                          VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
                                          void *responseBuffer = NULL, UInt32 responseBufferLength = 0, UInt64 transactionId = 0);
@@ -82,13 +82,99 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
       (*_packetReadyAction)(_packetActionTarget, pktHeader, pktHeaderLength, pktData, pktDataLength);
     }
     
-    if (_shouldFlushPackets) {
+    //
+    // Interrupts are left masked in polled mode.
+    //
+    if (_shouldFlushPackets && !_isRxPolling && _rxBusyPollBudgetUS == 0) {
       _rxBuffer->interruptMask = 0;
       __sync_synchronize();
     
       getAvailableRxSpace(&readBytes, &writeBytes);
     }
-  } while (_shouldFlushPackets && readBytes != 0);
+  } while (_shouldFlushPackets && !_isRxPolling && _rxBusyPollBudgetUS == 0 && readBytes != 0);
+
+  //
+  // Notify child that all available packets have been processed.
+  //
+  if (_packetDrainAction != nullptr) {
+    (*_packetDrainAction)(_packetActionTarget);
+  }
+
+  //
+  // If interrupts are still masked, either busy-poll the RX buffer or check it again after the poll interval.
+  // This also covers the child switching back to interrupt mode during the drain action.
+  //
+  if (_shouldFlushPackets && _rxBuffer->interruptMask != 0) {
+    if (_rxBusyPollBudgetUS != 0 && !_isRxPolling) {
+      thread_call_enter(_rxBusyPollThread);
+    } else if (_rxPollSTimerSource != nullptr) {
+      _rxPollSTimerSource->setTimeoutUS(_rxPollIntervalUS);
+    } else if (_rxPollTimerSource != nullptr) {
+      _rxPollTimerSource->setTimeoutUS(_rxPollIntervalUS);
+    }
+  }
+}
+
+void HyperVVMBusDevice::handleRxBusyPoll() {
+  VMBusRingBuffer *rxBuffer = _rxBuffer;
+  UInt64 currentTime;
+  UInt64 deadline;
+  UInt32 spinCount      = 0;
+  UInt32 spinRetries    = getHvController()->getLongSpinWaitRetries();
+  bool   notifySpinWait = getHvController()->isLongSpinWaitNotifyRecommended();
+
+  //
+  // Spin on the RX buffer until a packet arrives or the budget runs out.
+  // Packets are processed on the work loop as if an interrupt had occurred.
+  // On over-committed hosts, Hyper-V is notified after the recommended number of spins.
+  // The channel is not closed while a busy-poll is running, but use a snapshot of the RX ring regardless.
+  //
+  if (rxBuffer == nullptr) {
+    return;
+  }
+
+  clock_interval_to_deadline(_rxBusyPollBudgetUS, kMicrosecondScale, &deadline);
+  do {
+    if (!_channelIsOpen || _rxBusyPollBudgetUS == 0) {
+      break;
+    }
+    if (getRingReadIndex(rxBuffer) != getRingWriteIndex(rxBuffer)) {
+      _interruptSource->interruptOccurred(nullptr, this, 0);
+      return;
+    }
+
+    __asm__ volatile ("pause");
+    if (notifySpinWait && ++spinCount >= spinRetries) {
+      getHvController()->hypercallNotifyLongSpinWait(spinCount);
+      spinCount = 0;
+    }
+    clock_get_uptime(&currentTime);
+  } while (currentTime < deadline);
+
+  //
+  // Budget is exhausted, unmask interrupts.
+  // A packet may have arrived before interrupts were unmasked, check once more.
+  //
+  if (!_channelIsOpen) {
+    return;
+  }
+  rxBuffer->interruptMask = 0;
+  __sync_synchronize();
+  if (getRingReadIndex(rxBuffer) != getRingWriteIndex(rxBuffer)) {
+    _interruptSource->interruptOccurred(nullptr, this, 0);
+  }
+}
+
+void HyperVVMBusDevice::handleRxPollTimer(IOEventSource *sender) {
+  if (_packetActionTarget == nullptr || !_channelIsOpen) {
+    return;
+  }
+  handleInterrupt(_interruptSource, 0);
+}
+
+IOReturn HyperVVMBusDevice::stopRxBusyPollGated() {
+  _rxBusyPollBudgetUS = 0;
+  return kIOReturnSuccess;
 }
 
 IOReturn HyperVVMBusDevice::openVMBusChannelGated(UInt32 *txSize, UInt32 *rxSize) {
@@ -234,13 +320,23 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   UInt32 pktTotalLength         = pktHeaderLength + *bufferLength;
   UInt32 pktTotalLengthAligned  = HV_PACKETALIGN(pktTotalLength);
 
-  UInt32 writeIndexOld          = _txBuffer->writeIndex;
-  UInt32 writeIndexNew          = writeIndexOld;
-  UInt64 writeIndexShifted      = ((UInt64)writeIndexOld) << 32;
+  UInt32 writeIndexOld;
+  UInt32 writeIndexNew;
+  UInt64 writeIndexShifted;
 
   UInt32 readBytes;
   UInt32 writeBytes;
 
+  //
+  // Channel may have been closed while a child driver still holds completions.
+  //
+  if (!_channelIsOpen || _txBuffer == nullptr) {
+    return kIOReturnNotOpen;
+  }
+  writeIndexOld     = _txBuffer->writeIndex;
+  writeIndexNew     = writeIndexOld;
+  writeIndexShifted = ((UInt64)writeIndexOld) << 32;
+
   //
   // Ensure there is space for the packet.
   //